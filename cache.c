@@ -0,0 +1,43 @@
+#include "cache.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+bool cache_path(const char *name, char *path, size_t len)
+{
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	char base[PATH_MAX];
+	if (xdg && xdg[0] == '/') {
+		snprintf(base, sizeof(base), "%s", xdg);
+	} else if (home && home[0]) {
+		snprintf(base, sizeof(base), "%s/.cache", home);
+	} else {
+		return false;
+	}
+	int n = snprintf(path, len, "%s/shaderbg/%s", base, name);
+	return n > 0 && (size_t)n < len;
+}
+
+bool cache_make_parent_dirs(const char *path)
+{
+	char dir[PATH_MAX];
+	snprintf(dir, sizeof(dir), "%s", path);
+	for (char *c = dir + 1; *c; c++) {
+		if (*c != '/') {
+			continue;
+		}
+		*c = '\0';
+		if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+			fprintf(stderr, "Failed to create cache directory "
+					"'%s': %s\n",
+					dir, strerror(errno));
+			return false;
+		}
+		*c = '/';
+	}
+	return true;
+}
@@ -0,0 +1,17 @@
+#ifndef SHADERBG_CACHE_H
+#define SHADERBG_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Files generated on the first run and reused later, kept in
+ * $XDG_CACHE_HOME/shaderbg (by default ~/.cache/shaderbg) */
+
+/* Full path of the cache file name (which may include subdirectories);
+ * false if there is no cache directory, or the path is too long */
+bool cache_path(const char *name, char *path, size_t len);
+
+/* Create the directory containing path, and any missing parents */
+bool cache_make_parent_dirs(const char *path);
+
+#endif
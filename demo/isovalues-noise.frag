@@ -0,0 +1,23 @@
+// vi: ft=glsl
+// The isovalues of demo/isovalues3 (without the feedback buffer), using the
+// built-in iNoise3D texture instead of hashing 16 lattice points per pixel
+
+// 32^3 random values, interpolated by the sampler; smoothing the fractional
+// part keeps the derivative continuous at cell borders
+vec4 noise3(vec3 x) {
+    vec3 p = floor(x), f = fract(x);
+    f = f*f*(3.-2.*f);
+    return texture3D(iNoise3D, (p + f + .5) / 32.);
+}
+
+void mainImage( out vec4 O, vec2 U )
+{
+    vec2 R = iResolution.xy;
+    vec4 c = noise3(vec3(U*8./R.y, .1*iTime));
+    float n = (c.r + c.g) / 2.; // two channels, like noise(x) + noise(x+11.5)
+    float v = sin(6.28*10.*n);
+
+    v = smoothstep(1.,0., .5*abs(v)/fwidth(v));
+
+    O = mix(vec4(0), .5+.5*sin(12.*n+vec4(0,2.1,-2.1,0)), v);
+}
@@ -0,0 +1,33 @@
+// vi: ft=glsl
+// Lorenz attractor drawn as line segments that persist and fade, instead of
+// every pixel measuring its distance to every segment (compare demo/lorenz):
+//   shaderbg --state demo/lorenz-lines/state.glsl --geometry 97 \
+//       --primitive line-strip --fade .5 '*' demo/lorenz-lines/lorenz.vert
+
+#define MODE xz                       // choose which 2D projection to draw
+
+const float O = 10., P = 28., B = 8./3.; // System Parameters
+const float DT = .05 / 96.;
+const float VIEW_SCALE = .015,
+             INTENSITY = .5;
+
+vec3 Integrate(vec3 cur, float dt)    // Calculate the next position
+{
+    return cur + dt * vec3(    O  * (cur.y - cur.x)       ,
+                            cur.x * (P - cur.z) - cur.y   ,
+                            cur.x *   cur.y     - B*cur.z   );
+}
+
+void mainVertex(out vec4 position, out vec4 color, in float vertexId)
+{
+    // vertex i lies i integration steps past the current position
+    vec3 p = getState(0).xyz;
+    for (float i = 0.; i < vertexId; i++)
+        p = Integrate(p, DT);
+
+    vec2 uv = p.MODE - vec2(0., 25.); // the attractor is centered at z ~ 25
+    uv *= VIEW_SCALE * 2.;
+    uv.x *= iResolution.y / iResolution.x;
+    position = vec4(uv, 0., 1.);
+    color = vec4(.93, .36, .36, 1) * INTENSITY;
+}
@@ -0,0 +1,29 @@
+// vi: ft=glsl
+// Current position of the Lorenz system; lorenz.vert draws the path from
+// here that the next frame will follow.
+
+#define STATE_SIZE 1
+
+const float O = 10., P = 28., B = 8./3.; // System Parameters
+const int STEPS = 96;                    // must match the vertex count - 1
+const float DT = .05 / 96.;
+
+vec3 Integrate(vec3 cur, float dt)        // Calculate the next position
+{
+    return cur + dt * vec3(    O  * (cur.y - cur.x)       ,
+                            cur.x * (P - cur.z) - cur.y   ,
+                            cur.x *   cur.y     - B*cur.z   );
+}
+
+void initState(inout vec4 s[STATE_SIZE])
+{
+    s[0] = vec4(1, 1, 20, 0);             // close to the attractor
+}
+
+void stepState(inout vec4 s[STATE_SIZE])
+{
+    vec3 p = s[0].xyz;
+    for (int i = 0; i < STEPS; i++)
+        p = Integrate(p, DT);
+    s[0] = vec4(p, 0);
+}
@@ -0,0 +1,36 @@
+// vi: ft=glsl
+// Draws the trail kept by state.glsl:
+//   shaderbg --state demo/lorenz-state/state.glsl '*' demo/lorenz-state/image.frag
+
+#define TRAIL (STATE_SIZE - 2)
+#define MODE xz                       // choose which 2D projection to draw
+
+const float VIEW_SCALE = .015,
+             INTENSITY = .6;
+
+float Line(vec2 a, vec2 b, vec2 U)    // Distance to a line segment https://www.shadertoy.com/view/llySRh
+{
+    U -= a, b -= a;
+    float h = dot( U, b ) / dot(b,b),
+          c = clamp(h, 0., 1.);
+    return length( U - b * c );
+}
+
+void mainImage( out vec4 O, vec2 U )
+{
+    vec2 uv = (U - .5 * iResolution.xy) / iResolution.y / VIEW_SCALE;
+    uv.y += 25.;                      // the attractor is centered at z ~ 25
+    float pix = 1. / iResolution.y / VIEW_SCALE;
+
+    int head = int(getState(TRAIL + 1).x);
+    float c = 0.;
+    vec2 prev = getState(1 + head).MODE;
+    for (int i = 1; i < TRAIL; i++) {
+        int k = int(mod(float(head - i + TRAIL), float(TRAIL)));
+        vec2 p = getState(1 + k).MODE;
+        float age = 1. - float(i) / float(TRAIL);
+        c = max(c, age * smoothstep(2. * pix, 0., Line(prev, p, uv)));
+        prev = p;
+    }
+    O = vec4(.93, .36, .36, 1) * c * INTENSITY * 1.5;
+}
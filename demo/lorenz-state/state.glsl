@@ -0,0 +1,40 @@
+// vi: ft=glsl
+// Lorenz attractor, integrated in the simulation stage (run with --state)
+//
+// s[0]       current position
+// s[1..TRAIL] ring of past positions
+// s[TRAIL+1] .x = index of the newest ring entry
+
+#define TRAIL 64
+#define STATE_SIZE 66
+
+const float O = 10., P = 28., B = 8./3.; // System Parameters
+const int SUBSTEPS = 16;                 // integration steps per frame
+const float DT = .002;
+
+vec3 Integrate(vec3 cur, float dt)        // Calculate the next position
+{
+    return cur + dt * vec3(    O  * (cur.y - cur.x)       ,
+                            cur.x * (P - cur.z) - cur.y   ,
+                            cur.x *   cur.y     - B*cur.z   );
+}
+
+void initState(inout vec4 s[STATE_SIZE])
+{
+    vec3 start = vec3(1, 1, 20);  // close to the attractor
+    for (int i = 0; i < STATE_SIZE; i++)
+        s[i] = vec4(start, 0);
+    s[TRAIL + 1] = vec4(0);
+}
+
+void stepState(inout vec4 s[STATE_SIZE])
+{
+    vec3 p = s[0].xyz;
+    for (int i = 0; i < SUBSTEPS; i++)
+        p = Integrate(p, DT);
+    s[0] = vec4(p, 0);
+
+    int head = int(mod(s[TRAIL + 1].x + 1., float(TRAIL)));
+    s[1 + head] = vec4(p, 0);
+    s[TRAIL + 1].x = float(head);
+}
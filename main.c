@@ -1,3 +1,8 @@
+#include "noise.h"
+#include "power.h"
+#include "shm.h"
+#include "spirv.h"
+#include "trace.h"
 #include "wlr-layer-shell-unstable-v1-client-protocol.h"
 #include <EGL/egl.h>
 #include <EGL/eglext.h>
@@ -8,6 +13,9 @@
 #include <getopt.h>
 #include <math.h> // For INFINITY
 #include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -18,13 +26,130 @@
 #include <wayland-egl.h>
 
 static char usage[] = {
-		"shaderbg [-h|--fps F|--layer l|--speed S] output-name shader.frag\n"
-		"The provided fragment shaders should follow the Shadertoy API\n"};
+		"shaderbg [-h|--fps F|--layer l|--speed S|--shm|--stats] "
+		"[power options] output-name shader.frag\n"
+		"The provided fragment shaders should follow the Shadertoy API\n"
+		"  --span                  show one image across all outputs\n"
+		"  --shm                   render offscreen, present via wl_shm\n"
+		"  --stats                 periodically print performance stats\n"
+		"  --trace FILE            record frame loop timings to FILE, in\n"
+		"                          Chrome trace-event (Perfetto) format\n"
+		"  --state FILE            simulation stage updating a small\n"
+		"                          state, once per frame\n"
+		"  --no-compute            step the state with a fragment pass,\n"
+		"                          even if compute shaders are available\n"
+		"  --tick-rate T           step the state T times per second,\n"
+		"                          independent of the frame rate\n"
+		"  --max-substeps K        most state steps per frame with\n"
+		"                          --tick-rate (default 16)\n"
+		"  --geometry N            shader is a vertex shader with N\n"
+		"                          vertices, accumulated over frames\n"
+		"  --primitive P           one of points (default), lines,\n"
+		"                          line-strip\n"
+		"  --render-fps R          run the shader R times per second,\n"
+		"                          and blend the frames in between\n"
+		"  --fade F                fraction of the geometry that is\n"
+		"                          left after a second (default 0.5)\n"
+		"  --format F              one of rgba8888 (default), xrgb8888,\n"
+		"                          rgb565, xrgb2101010, argb2101010\n"
+		"  --bench-formats         compare render cost of all formats\n"
+		"  --spirv                 build the shader through SPIR-V, using\n"
+		"                          glslangValidator and spirv-opt\n"
+		"  --bench-spirv           compare render cost of the GLSL and\n"
+		"                          SPIR-V builds\n"
+		"Power options:\n"
+		"  --no-power-policy       ignore battery and thermal state\n"
+		"  --battery-fps F         fps cap while on battery\n"
+		"  --battery-scale S       render scale while on battery\n"
+		"  --throttle-temp C       reduce fps and scale above C degrees\n"
+		"  --pause-temp C          pause rendering above C degrees\n"
+		"  --power-supply-dir DIR  instead of /sys/class/power_supply\n"
+		"  --thermal-dir DIR       instead of /sys/class/thermal\n"};
+
+enum long_only_options {
+	OPT_NO_POWER_POLICY = 256,
+	OPT_BATTERY_FPS,
+	OPT_BATTERY_SCALE,
+	OPT_THROTTLE_TEMP,
+	OPT_PAUSE_TEMP,
+	OPT_POWER_SUPPLY_DIR,
+	OPT_THERMAL_DIR,
+	OPT_SHM,
+	OPT_STATS,
+	OPT_FORMAT,
+	OPT_BENCH_FORMATS,
+	OPT_TRACE,
+	OPT_STATE,
+	OPT_NO_COMPUTE,
+	OPT_GEOMETRY,
+	OPT_PRIMITIVE,
+	OPT_FADE,
+	OPT_TICK_RATE,
+	OPT_MAX_SUBSTEPS,
+	OPT_RENDER_FPS,
+	OPT_SPAN,
+	OPT_SPIRV,
+	OPT_BENCH_SPIRV,
+};
 
 static const struct option options[] = {{"help", no_argument, NULL, 'h'},
 		{"speed", required_argument, NULL, 's'},
 		{"fps", required_argument, NULL, 'f'},
-		{"layer", required_argument, NULL, 'l'}, {0, 0, NULL, 0}};
+		{"layer", required_argument, NULL, 'l'},
+		{"no-power-policy", no_argument, NULL, OPT_NO_POWER_POLICY},
+		{"battery-fps", required_argument, NULL, OPT_BATTERY_FPS},
+		{"battery-scale", required_argument, NULL, OPT_BATTERY_SCALE},
+		{"throttle-temp", required_argument, NULL, OPT_THROTTLE_TEMP},
+		{"pause-temp", required_argument, NULL, OPT_PAUSE_TEMP},
+		{"power-supply-dir", required_argument, NULL,
+				OPT_POWER_SUPPLY_DIR},
+		{"thermal-dir", required_argument, NULL, OPT_THERMAL_DIR},
+		{"shm", no_argument, NULL, OPT_SHM},
+		{"stats", no_argument, NULL, OPT_STATS},
+		{"format", required_argument, NULL, OPT_FORMAT},
+		{"bench-formats", no_argument, NULL, OPT_BENCH_FORMATS},
+		{"trace", required_argument, NULL, OPT_TRACE},
+		{"state", required_argument, NULL, OPT_STATE},
+		{"no-compute", no_argument, NULL, OPT_NO_COMPUTE},
+		{"geometry", required_argument, NULL, OPT_GEOMETRY},
+		{"primitive", required_argument, NULL, OPT_PRIMITIVE},
+		{"fade", required_argument, NULL, OPT_FADE},
+		{"tick-rate", required_argument, NULL, OPT_TICK_RATE},
+		{"max-substeps", required_argument, NULL, OPT_MAX_SUBSTEPS},
+		{"render-fps", required_argument, NULL, OPT_RENDER_FPS},
+		{"span", no_argument, NULL, OPT_SPAN},
+		{"spirv", no_argument, NULL, OPT_SPIRV},
+		{"bench-spirv", no_argument, NULL, OPT_BENCH_SPIRV},
+		{0, 0, NULL, 0}};
+
+/* Pixel formats for the output surfaces. Formats without alpha let the
+ * compositor skip blending the (full-screen) surface. */
+struct surface_format {
+	const char *name;
+	EGLint red_size, green_size, blue_size, alpha_size;
+	GLenum internal_format; // for offscreen framebuffers
+	uint32_t shm_format;
+	int shm_bytes_per_pixel;
+	GLenum read_format, read_type; // matching shm_format's memory layout
+};
+
+static const struct surface_format surface_formats[] = {
+		{"rgba8888", 8, 8, 8, 8, GL_RGBA8, WL_SHM_FORMAT_ARGB8888, 4,
+				GL_BGRA, GL_UNSIGNED_BYTE},
+		{"xrgb8888", 8, 8, 8, 0, GL_RGB8, WL_SHM_FORMAT_XRGB8888, 4,
+				GL_BGRA, GL_UNSIGNED_BYTE},
+		{"rgb565", 5, 6, 5, 0, GL_RGB565, WL_SHM_FORMAT_RGB565, 2,
+				GL_RGB, GL_UNSIGNED_SHORT_5_6_5},
+		{"xrgb2101010", 10, 10, 10, 0, GL_RGB10_A2,
+				WL_SHM_FORMAT_XRGB2101010, 4, GL_BGRA,
+				GL_UNSIGNED_INT_2_10_10_10_REV},
+		{"argb2101010", 10, 10, 10, 2, GL_RGB10_A2,
+				WL_SHM_FORMAT_ARGB2101010, 4, GL_BGRA,
+				GL_UNSIGNED_INT_2_10_10_10_REV},
+};
+
+#define NUM_SURFACE_FORMATS                                                    \
+	(sizeof(surface_formats) / sizeof(surface_formats[0]))
 
 // Define all PFNGL* types here, as they are needed for eglGetProcAddress
 PFNGLCREATESHADERPROC glCreateShader;
@@ -52,7 +177,27 @@ PFNGLUNIFORM3FPROC glUniform3f;
 PFNGLUNIFORM4FPROC glUniform4f;
 PFNGLUNIFORM1IPROC glUniform1i;
 PFNGLDELETESHADERPROC glDeleteShader;
+PFNGLDELETEPROGRAMPROC glDeleteProgram;
 PFNGLENABLEVERTEXATTRIBARRAYPROC glEnableVertexAttribArray;
+PFNGLGENFRAMEBUFFERSPROC glGenFramebuffers;
+PFNGLDELETEFRAMEBUFFERSPROC glDeleteFramebuffers;
+PFNGLBINDFRAMEBUFFERPROC glBindFramebuffer;
+PFNGLFRAMEBUFFERTEXTURE2DPROC glFramebufferTexture2D;
+PFNGLCHECKFRAMEBUFFERSTATUSPROC glCheckFramebufferStatus;
+PFNGLBLITFRAMEBUFFERPROC glBlitFramebuffer;
+PFNGLMAXSHADERCOMPILERTHREADSKHRPROC glMaxShaderCompilerThreadsKHR;
+PFNGLDISPATCHCOMPUTEPROC glDispatchCompute;
+PFNGLBINDIMAGETEXTUREPROC glBindImageTexture;
+PFNGLMEMORYBARRIERPROC glMemoryBarrier;
+PFNGLGENQUERIESPROC glGenQueries;
+PFNGLBEGINQUERYPROC glBeginQuery;
+PFNGLENDQUERYPROC glEndQuery;
+PFNGLGETQUERYOBJECTIVPROC glGetQueryObjectiv;
+PFNGLGETQUERYOBJECTUI64VPROC glGetQueryObjectui64v;
+PFNGLSHADERBINARYPROC glShaderBinary;
+PFNGLSPECIALIZESHADERPROC glSpecializeShader;
+PFNGLGETPROGRAMINTERFACEIVPROC glGetProgramInterfaceiv;
+PFNGLGETPROGRAMRESOURCEIVPROC glGetProgramResourceiv;
 
 #define load_gl_func(type, name)                                               \
 	name = (type)eglGetProcAddress(#name);                                 \
@@ -89,14 +234,94 @@ void load_gl_funcs()
 	load_gl_func(PFNGLUNIFORM4FPROC, glUniform4f);
 	load_gl_func(PFNGLUNIFORM1IPROC, glUniform1i);
 	load_gl_func(PFNGLDELETESHADERPROC, glDeleteShader);
+	load_gl_func(PFNGLDELETEPROGRAMPROC, glDeleteProgram);
 	load_gl_func(PFNGLENABLEVERTEXATTRIBARRAYPROC,
 			glEnableVertexAttribArray);
+	load_gl_func(PFNGLGENFRAMEBUFFERSPROC, glGenFramebuffers);
+	load_gl_func(PFNGLDELETEFRAMEBUFFERSPROC, glDeleteFramebuffers);
+	load_gl_func(PFNGLBINDFRAMEBUFFERPROC, glBindFramebuffer);
+	load_gl_func(PFNGLFRAMEBUFFERTEXTURE2DPROC, glFramebufferTexture2D);
+	load_gl_func(PFNGLCHECKFRAMEBUFFERSTATUSPROC, glCheckFramebufferStatus);
+	load_gl_func(PFNGLBLITFRAMEBUFFERPROC, glBlitFramebuffer);
+	/* optional, only used if GL_KHR_parallel_shader_compile is present */
+	glMaxShaderCompilerThreadsKHR = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)
+			eglGetProcAddress("glMaxShaderCompilerThreadsKHR");
+	/* optional, only used for the simulation stage with GL >= 4.3 */
+	glDispatchCompute = (PFNGLDISPATCHCOMPUTEPROC)eglGetProcAddress(
+			"glDispatchCompute");
+	glBindImageTexture = (PFNGLBINDIMAGETEXTUREPROC)eglGetProcAddress(
+			"glBindImageTexture");
+	glMemoryBarrier = (PFNGLMEMORYBARRIERPROC)eglGetProcAddress(
+			"glMemoryBarrier");
+	/* optional, only used to time passes for --stats */
+	glGenQueries = (PFNGLGENQUERIESPROC)eglGetProcAddress("glGenQueries");
+	glBeginQuery = (PFNGLBEGINQUERYPROC)eglGetProcAddress("glBeginQuery");
+	glEndQuery = (PFNGLENDQUERYPROC)eglGetProcAddress("glEndQuery");
+	glGetQueryObjectiv = (PFNGLGETQUERYOBJECTIVPROC)eglGetProcAddress(
+			"glGetQueryObjectiv");
+	glGetQueryObjectui64v = (PFNGLGETQUERYOBJECTUI64VPROC)
+			eglGetProcAddress("glGetQueryObjectui64v");
+	/* optional, only used for --spirv */
+	glShaderBinary = (PFNGLSHADERBINARYPROC)eglGetProcAddress(
+			"glShaderBinary");
+	glSpecializeShader = (PFNGLSPECIALIZESHADERPROC)eglGetProcAddress(
+			"glSpecializeShaderARB");
+	glGetProgramInterfaceiv = (PFNGLGETPROGRAMINTERFACEIVPROC)
+			eglGetProcAddress("glGetProgramInterfaceiv");
+	glGetProgramResourceiv = (PFNGLGETPROGRAMRESOURCEIVPROC)
+			eglGetProcAddress("glGetProgramResourceiv");
 }
 #undef load_gl_func
 
+/* Measures the GPU time of a pass with timer queries, without waiting for
+ * the results; passes started while every query is in flight are counted
+ * but not timed */
+#define GPU_TIMER_QUERIES 4
+struct gpu_timer {
+	GLuint queries[GPU_TIMER_QUERIES];
+	bool pending[GPU_TIMER_QUERIES];
+	int next;
+	bool running;
+	uint64_t passes, timed; // since the last --stats report
+	double seconds;         // GPU time of the timed passes
+};
+
+/* Where the main loop spends its time, for --stats; whatever is left is
+ * the loop's own overhead (output list walks, scheduling) */
+struct loop_stats {
+	uint64_t iterations;
+	uint64_t events;      // Wayland events dispatched
+	double dispatch_time; // seconds dispatching events and flushing
+	double wait_time;     // seconds in poll and reading events
+	double work_time;     // seconds stepping, drawing and presenting
+};
+
+/* The image shader's uniforms, see image_uniforms */
+enum uniform_index {
+	UNIF_RESOLUTION,
+	UNIF_TIME,
+	UNIF_TIME_DELTA,
+	UNIF_FRAME,
+	UNIF_MOUSE,
+	UNIF_OFFSET,
+	UNIF_STATE,
+	UNIF_NOISE, // one per noise texture
+	NUM_UNIFORMS = UNIF_NOISE + NUM_NOISE_TEXTURES,
+};
+
 struct state {
-	float fps;   // how often to update output
-	float speed; // ratio of real time to shader time
+	float fps;           // how often to update output
+	float requested_fps; // fps from the command line, before power policy
+	float speed;         // ratio of real time to shader time
+	float render_scale;  // fraction of output size the shader is run at
+	struct power_policy power;
+	/* if set, render offscreen and present through wl_shm buffers */
+	bool use_shm;
+	bool has_shm_format; // compositor supports format->shm_format
+	bool print_stats;
+	const struct surface_format *format;
+	struct shm_stats shm_stats;
+	struct loop_stats loop_stats;
 	enum zwlr_layer_shell_v1_layer layer;
 	char *output_name;
 	char *shader_path;
@@ -107,19 +332,112 @@ struct state {
 	EGLContext egl_context;
 	struct wl_compositor *compositor;
 	struct zwlr_layer_shell_v1 *layer_shell;
+	struct wl_shm *shm;
 	float current_time;
 	float delta_time;
 	uint64_t frame_no;
+	/* Shader build; until shader_ready is set, outputs show a
+	 * placeholder. The build runs either in the driver's compiler threads
+	 * (parallel_compile) or on a worker thread with a shared context. */
+	bool shader_ready;
+	bool parallel_compile;
+	char *frag_text;
+	GLuint frag_shader;
+	GLuint vertex_shader;
+	EGLContext worker_context;
+	pthread_t worker;
+	atomic_bool worker_done;
+	/* startup metrics */
+	struct timespec launch_time;
+	bool shown_first_frame;
+	bool shown_first_real_frame;
+	/* Simulation stage (--state): a vec4[STATE_SIZE] array, stored in an
+	 * STATE_SIZE x 1 float texture that the image pass samples as
+	 * iState. A compute shader updates the texture in place; without
+	 * compute shaders, a fragment pass over a STATE_SIZE x 1 viewport
+	 * ping-pongs between two textures. */
+	char *state_path;
+	char *state_text;
+	int state_size;
+	char state_decl[256]; // image shader declarations for the state
+	/* GLSL declarations of the uniforms the shader can use */
+	char uniform_decl[1024];
+	bool allow_compute;
+	bool state_compute;
+	GLuint state_prog;
+	GLuint state_shaders[2]; // while building; the second may be 0
+	GLuint state_tex[2];
+	GLuint state_fbo[2];
+	int state_current; // index of the texture with the latest state
+	uint64_t state_steps;
+	/* With a tick rate, the state advances in fixed steps of shader time
+	 * (up to max_substeps per frame), instead of once per frame. Time
+	 * beyond that is dropped, so a slow frame cannot snowball. */
+	float tick_rate;
+	int max_substeps;
+	double tick_debt; // steps due but not run yet, including a fraction
+	uint64_t ticks_run, ticks_dropped; // since the last --stats report
+	GLint unif_state_iTime;
+	GLint unif_state_iTimeDelta;
+	GLint unif_state_iFrame;
+	GLint unif_state_prev;
+	/* Geometry mode (--geometry): the shader is a vertex shader run for
+	 * vertex_count vertices. Its primitives are added onto a per-output
+	 * accumulation buffer, which fades by the given fraction per
+	 * second. */
+	GLsizei vertex_count;
+	GLenum primitive;
+	float fade;
+	GLuint vertex_id_buffer;
+	GLuint fade_prog;
+	GLint unif_iVertexCount;
+	/* With --render-fps, the shader only runs render_fps times per
+	 * second (of shader time), and frames in between blend the two
+	 * latest results */
+	float render_fps;
+	bool has_timer_queries;
+	GLuint blend_prog;
+	GLint unif_blend_prev;
+	GLint unif_blend_next;
+	GLint unif_blend_size;
+	GLint unif_blend_mix;
+	struct gpu_timer shader_timer;
+	struct gpu_timer blend_timer;
 	GLuint shader_prog;
 	GLuint attr_pos;
-	GLuint unif_iResolution;
-	GLuint unif_iTime;
-	GLuint unif_iTimeDelta;
-	GLuint unif_iFrame;
-	GLuint unif_iMouse;
+	GLint unif[NUM_UNIFORMS]; // locations in shader_prog, or -1
 	GLuint vertex_buffer;
 	GLuint vertex_array;
 	struct wl_list outputs;
+	int next_trace_track;
+	/* With --span, the shader draws one image over the bounding box of
+	 * all outputs shown on (in the compositor's logical coordinates),
+	 * and each output renders only its own part of it */
+	bool span;
+	bool canvas_dirty; // set when outputs move, resize or go away
+	int32_t canvas_x0, canvas_y0, canvas_x1, canvas_y1;
+	/* Noise textures, loaded only if the shader mentions them; texture i
+	 * is bound to unit NOISE_TEXTURE_UNIT + i */
+	GLuint noise_tex[NUM_NOISE_TEXTURES];
+	/* With --spirv, the shader program is built from SPIR-V compiled
+	 * offline, where GL_ARB_gl_spirv is available. If a binary is
+	 * rejected, the build falls back to GLSL. */
+	bool use_spirv;
+	bool spirv_building; // the tools run on spirv_thread
+	pthread_t spirv_thread;
+	atomic_bool spirv_done;
+	struct spirv_binary spirv_frag, spirv_vert;
+};
+
+/* unit 0 holds the simulation state, unit 1 the frames being blended */
+#define NOISE_TEXTURE_UNIT 2
+
+/* A framebuffer with a single texture as color attachment */
+struct render_target {
+	GLuint fbo;
+	GLuint tex;
+	int width, height;
+	GLenum internal_format;
 };
 
 struct output {
@@ -128,15 +446,35 @@ struct output {
 	uint32_t output_name;
 	struct wl_output *output;
 	char *str_name;
+	int32_t x, y; // position in the compositor's global space
+	int trace_track;
 	/* surface and following elements are only set up if output name matches
 	 * request */
 	struct wl_surface *surface;
 	struct zwlr_layer_surface_v1 *layer_surface;
 	struct wl_egl_window *egl_window;
 	EGLSurface egl_surface;
+	/* wl_shm presentation; the pool is sized to the output */
+	struct shm_pool *shm_pool;
+	/* buffer holding a new frame, to be attached on the next present */
+	struct shm_buffer *shm_buffer;
 	/* if frame_callback is nonzero, do not render frame yet */
 	struct wl_callback *frame_callback;
 	int width, height;
+	/* offscreen target used when rendering below output resolution, or
+	 * when rendering without a window surface */
+	struct render_target scaled;
+	/* vertically flipped copy of the frame, read back for wl_shm */
+	struct render_target readback;
+	/* sum of the faded geometry drawn so far, in geometry mode */
+	struct render_target accum;
+	/* with --render-fps, the two latest shader frames, and the shader
+	 * time at which each was rendered */
+	struct render_target frames[2];
+	float frame_time[2];
+	int latest_frame;
+	int valid_frames; // how many frames have been rendered at this size
+	bool configured;
 	bool needs_ack;
 	bool needs_resize;
 	uint32_t last_serial;
@@ -153,11 +491,74 @@ static bool check_gl_errors(const char *where)
 	return !has_problems;
 }
 
+static void destroy_render_target(struct render_target *target)
+{
+	if (target->fbo) {
+		glDeleteFramebuffers(1, &target->fbo);
+		glDeleteTextures(1, &target->tex);
+	}
+	*target = (struct render_target){0};
+}
+
+static void gpu_timer_collect(struct gpu_timer *timer)
+{
+	for (int i = 0; i < GPU_TIMER_QUERIES; i++) {
+		if (!timer->pending[i]) {
+			continue;
+		}
+		GLint available = GL_FALSE;
+		glGetQueryObjectiv(timer->queries[i],
+				GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available) {
+			continue;
+		}
+		GLuint64 ns = 0;
+		glGetQueryObjectui64v(timer->queries[i], GL_QUERY_RESULT, &ns);
+		timer->pending[i] = false;
+		timer->seconds += 1e-9 * ns;
+		timer->timed++;
+	}
+}
+
+static void gpu_timer_begin(struct state *state, struct gpu_timer *timer)
+{
+	timer->passes++;
+	if (!state->has_timer_queries) {
+		return;
+	}
+	if (!timer->queries[0]) {
+		glGenQueries(GPU_TIMER_QUERIES, timer->queries);
+	}
+	gpu_timer_collect(timer);
+	if (timer->pending[timer->next]) {
+		return;
+	}
+	glBeginQuery(GL_TIME_ELAPSED, timer->queries[timer->next]);
+	timer->running = true;
+}
+
+static void gpu_timer_end(struct gpu_timer *timer)
+{
+	if (!timer->running) {
+		return;
+	}
+	glEndQuery(GL_TIME_ELAPSED);
+	timer->running = false;
+	timer->pending[timer->next] = true;
+	timer->next = (timer->next + 1) % GPU_TIMER_QUERIES;
+}
+
 static void destroy_output(struct output *output)
 {
 	if (output->frame_callback) {
 		wl_callback_destroy(output->frame_callback);
 	}
+	destroy_render_target(&output->scaled);
+	destroy_render_target(&output->readback);
+	destroy_render_target(&output->accum);
+	destroy_render_target(&output->frames[0]);
+	destroy_render_target(&output->frames[1]);
+	shm_pool_destroy(output->shm_pool);
 	if (output->egl_surface) {
 		eglDestroySurface(output->state->egl_display,
 				output->egl_surface);
@@ -172,7 +573,9 @@ static void destroy_output(struct output *output)
 		wl_egl_window_destroy(output->egl_window);
 	}
 	free(output->str_name);
-	wl_output_destroy(output->output);
+	output->state->canvas_dirty = true;
+	/* unlike wl_output_destroy, lets the compositor free its side too */
+	wl_output_release(output->output);
 	wl_list_remove(&output->link);
 	free(output);
 }
@@ -197,15 +600,180 @@ static struct wl_callback_listener frame_callback_listener = {
 		.done = frame_done,
 };
 
-static void redraw(struct output *output)
+/* (Re)create an offscreen target, if its size does not match, and leave its
+ * framebuffer bound. Exits if the framebuffer is unusable. */
+static void ensure_render_target(struct render_target *target, int width,
+		int height, GLenum internal_format)
 {
-	struct state *state = output->state;
-	if (!eglMakeCurrent(state->egl_display, output->egl_surface,
-			    output->egl_surface, state->egl_context)) {
-		fprintf(stderr, "Failed to make current\n");
+	if (target->fbo && target->width == width &&
+			target->height == height &&
+			target->internal_format == internal_format) {
+		glBindFramebuffer(GL_FRAMEBUFFER, target->fbo);
+		return;
+	}
+	if (!target->fbo) {
+		glGenFramebuffers(1, &target->fbo);
+		glGenTextures(1, &target->tex);
+	}
+	glBindTexture(GL_TEXTURE_2D, target->tex);
+	glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, GL_RGBA,
+			GL_UNSIGNED_BYTE, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glBindFramebuffer(GL_FRAMEBUFFER, target->fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+			GL_TEXTURE_2D, target->tex, 0);
+	target->width = width;
+	target->height = height;
+	target->internal_format = internal_format;
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) !=
+			GL_FRAMEBUFFER_COMPLETE) {
+		fprintf(stderr, "Failed to create offscreen framebuffer\n");
 		exit(EXIT_FAILURE);
 	}
-	glViewport(0, 0, output->width, output->height);
+}
+
+/* Copy the rendered frame into a free wl_shm buffer. Only the region that
+ * changed since that buffer was last written is read back. */
+static void read_back_frame(struct output *output)
+{
+	struct state *state = output->state;
+	struct shm_pool *pool = output->shm_pool;
+	struct shm_buffer *buffer = output->shm_buffer;
+
+	/* flip (and if needed, upscale) on the GPU, so rows can be read
+	 * straight into the top-down shm buffer */
+	ensure_render_target(&output->readback, output->width, output->height,
+			state->format->internal_format);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, output->scaled.fbo);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, output->readback.fbo);
+	glBlitFramebuffer(0, 0, output->scaled.width, output->scaled.height, 0,
+			output->height, output->width, 0, GL_COLOR_BUFFER_BIT,
+			GL_LINEAR);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, output->readback.fbo);
+	/* wait for rendering first, so the copy time is measured alone */
+	glFinish();
+
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	int x = buffer->damage_x0, y = buffer->damage_y0;
+	int w = buffer->damage_x1 - x, h = buffer->damage_y1 - y;
+	if (w > 0 && h > 0) {
+		int bpp = pool->bytes_per_pixel;
+		glPixelStorei(GL_PACK_ROW_LENGTH, pool->stride / bpp);
+		glPixelStorei(GL_PACK_ALIGNMENT, bpp);
+		glReadPixels(x, y, w, h, state->format->read_format,
+				state->format->read_type,
+				buffer->data + y * pool->stride + bpp * x);
+		glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+		glPixelStorei(GL_PACK_ALIGNMENT, 4);
+		state->shm_stats.bytes_copied += (uint64_t)bpp * w * h;
+	}
+	shm_buffer_clear_damage(buffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	state->shm_stats.copy_time += (t1.tv_sec - t0.tv_sec) +
+				      1e-9 * (t1.tv_nsec - t0.tv_nsec);
+	state->shm_stats.frames++;
+}
+
+/* Recompute the bounding box of the outputs that have a surface */
+static void update_canvas(struct state *state)
+{
+	int32_t old_x0 = state->canvas_x0, old_y0 = state->canvas_y0;
+	int32_t old_x1 = state->canvas_x1, old_y1 = state->canvas_y1;
+	bool empty = true;
+	struct output *output;
+	wl_list_for_each(output, &state->outputs, link)
+	{
+		if (!output->surface || !output->width || !output->height) {
+			continue;
+		}
+		int32_t x1 = output->x + output->width;
+		int32_t y1 = output->y + output->height;
+		if (empty || output->x < state->canvas_x0) {
+			state->canvas_x0 = output->x;
+		}
+		if (empty || output->y < state->canvas_y0) {
+			state->canvas_y0 = output->y;
+		}
+		if (empty || x1 > state->canvas_x1) {
+			state->canvas_x1 = x1;
+		}
+		if (empty || y1 > state->canvas_y1) {
+			state->canvas_y1 = y1;
+		}
+		empty = false;
+	}
+	state->canvas_dirty = false;
+	if (state->canvas_x0 == old_x0 && state->canvas_y0 == old_y0 &&
+			state->canvas_x1 == old_x1 &&
+			state->canvas_y1 == old_y1) {
+		return;
+	}
+	/* frames kept for --render-fps show the old layout */
+	wl_list_for_each(output, &state->outputs, link)
+	{
+		output->valid_frames = 0;
+	}
+}
+
+/* Point iResolution at the whole canvas, and shift the fragment coordinates
+ * to the output's part of it. The drawn area is width x height, which is
+ * smaller than the output when rendering at reduced scale. */
+static void set_span_inputs(struct state *state, struct output *output,
+		int width, int height)
+{
+	if (state->canvas_dirty) {
+		update_canvas(state);
+	}
+	GLfloat sx = (GLfloat)width / output->width;
+	GLfloat sy = (GLfloat)height / output->height;
+	GLfloat w = sx * (state->canvas_x1 - state->canvas_x0);
+	GLfloat h = sy * (state->canvas_y1 - state->canvas_y0);
+	/* GL's y axis points up, Wayland's down */
+	GLfloat x = sx * (output->x - state->canvas_x0);
+	GLfloat y = sy * (state->canvas_y1 - output->y - output->height);
+	glUniform3f(state->unif[UNIF_RESOLUTION], w, h, 0.);
+	glUniform2f(state->unif[UNIF_OFFSET], x, y);
+}
+
+/* Set the uniforms of the (bound) shader program */
+static void set_shader_inputs(struct state *state, int width, int height)
+{
+	glUniform1f(state->unif[UNIF_TIME], state->current_time);
+	glUniform1f(state->unif[UNIF_TIME_DELTA], state->delta_time);
+	GLfloat w = width, h = height;
+	glUniform3f(state->unif[UNIF_RESOLUTION], w, h, 0.);
+	glUniform2f(state->unif[UNIF_OFFSET], 0., 0.);
+	glUniform1f(state->unif[UNIF_FRAME], (GLfloat)state->frame_no);
+	glUniform4f(state->unif[UNIF_MOUSE], 0., 0., 0., 0.);
+	if (state->state_size) {
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D,
+				state->state_tex[state->state_current]);
+		glUniform1i(state->unif[UNIF_STATE], 0);
+	}
+	for (int i = 0; i < NUM_NOISE_TEXTURES; i++) {
+		if (!state->noise_tex[i]) {
+			continue;
+		}
+		GLenum target = noise_textures[i].depth > 1 ? GL_TEXTURE_3D
+							    : GL_TEXTURE_2D;
+		glActiveTexture(GL_TEXTURE0 + NOISE_TEXTURE_UNIT + i);
+		glBindTexture(target, state->noise_tex[i]);
+		glUniform1i(state->unif[UNIF_NOISE + i],
+				NOISE_TEXTURE_UNIT + i);
+	}
+	glActiveTexture(GL_TEXTURE0);
+}
+
+/* Run the shader over a width x height viewport of the bound framebuffer;
+ * output is only needed for --span */
+static void draw_shader(struct state *state, struct output *output, int width,
+		int height)
+{
+	glViewport(0, 0, width, height);
 	glClear(GL_COLOR_BUFFER_BIT);
 	glBindVertexArray(state->vertex_array);
 	glBindBuffer(GL_ARRAY_BUFFER, state->vertex_buffer);
@@ -213,18 +781,285 @@ static void redraw(struct output *output)
 	// todo: why do we need to call this here?
 	glVertexAttribPointer(
 			state->attr_pos, 2, GL_FLOAT, GL_FALSE, 0, (void *)0);
-	glUniform1f(state->unif_iTime, state->current_time);
-	glUniform1f(state->unif_iTimeDelta, state->delta_time);
-	GLfloat w = output->width, h = output->height;
-	glUniform3f(state->unif_iResolution, w, h, 0.);
-	glUniform1i(state->unif_iFrame, state->frame_no);
-	glUniform4f(state->unif_iMouse, 0., 0., 0., 0.);
+	set_shader_inputs(state, width, height);
+	if (state->span && output) {
+		set_span_inputs(state, output, width, height);
+	}
+	glDrawArrays(GL_TRIANGLE_FAN, 0, 3);
+}
+
+/* Fade the accumulated geometry, add this frame's primitives, and copy the
+ * result into dest_fbo. Only a few hundred primitives are rasterized,
+ * instead of every pixel visiting every primitive. */
+static void draw_geometry(struct state *state, struct render_target *accum,
+		GLuint dest_fbo, int width, int height)
+{
+	bool fresh = accum->width != width || accum->height != height;
+	/* half floats, so dim trails keep fading instead of getting stuck
+	 * at the smallest 8-bit value */
+	ensure_render_target(accum, width, height, GL_RGBA16F);
+	glViewport(0, 0, width, height);
+	if (fresh) {
+		glClearColor(0.f, 0.f, 0.f, 1.f);
+		glClear(GL_COLOR_BUFFER_BIT);
+		glClearColor(0.f, 0.f, 0.f, 0.f);
+	}
+	/* alpha stays at 1 */
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_FALSE);
+	glEnable(GL_BLEND);
+	glBindVertexArray(state->vertex_array);
+
+	GLfloat keep = powf(state->fade, state->delta_time);
+	glBlendColor(keep, keep, keep, keep);
+	glBlendFunc(GL_ZERO, GL_CONSTANT_COLOR);
+	glUseProgram(state->fade_prog);
+	glBindBuffer(GL_ARRAY_BUFFER, state->vertex_buffer);
+	glVertexAttribPointer(
+			state->attr_pos, 2, GL_FLOAT, GL_FALSE, 0, (void *)0);
+	glDrawArrays(GL_TRIANGLE_FAN, 0, 3);
+
+	glBlendFunc(GL_ONE, GL_ONE);
+	glUseProgram(state->shader_prog);
+	set_shader_inputs(state, width, height);
+	glUniform1f(state->unif_iVertexCount, (GLfloat)state->vertex_count);
+	glBindBuffer(GL_ARRAY_BUFFER, state->vertex_id_buffer);
+	glVertexAttribPointer(
+			state->attr_pos, 1, GL_FLOAT, GL_FALSE, 0, (void *)0);
+	glDrawArrays(state->primitive, 0, state->vertex_count);
+
+	glDisable(GL_BLEND);
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, accum->fbo);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, dest_fbo);
+	glBlitFramebuffer(0, 0, width, height, 0, 0, width, height,
+			GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	glBindFramebuffer(GL_FRAMEBUFFER, dest_fbo);
+}
+
+/* Draw a frame for --render-fps: when due, run the shader into the older of
+ * the two frames, at width x height; then fill target_fbo, at the output's
+ * full size, with a blend between the two, which reaches the newest frame
+ * as the next one is due. The blend also does any upscaling. This shows
+ * frames one render period late, in exchange for smooth motion at a
+ * fraction of the shader's cost. */
+static void draw_interpolated(struct output *output, GLuint target_fbo,
+		int width, int height)
+{
+	struct state *state = output->state;
+	float period = state->speed / state->render_fps;
+	if (state->span && state->canvas_dirty) {
+		update_canvas(state);
+	}
+	int latest = output->latest_frame;
+	if (output->frames[latest].width != width ||
+			output->frames[latest].height != height) {
+		output->valid_frames = 0;
+	}
+	if (output->valid_frames == 0 ||
+			state->current_time >=
+					output->frame_time[latest] + period) {
+		int next = 1 - latest;
+		ensure_render_target(&output->frames[next], width, height,
+				state->format->internal_format);
+		gpu_timer_begin(state, &state->shader_timer);
+		draw_shader(state, output, width, height);
+		gpu_timer_end(&state->shader_timer);
+		output->latest_frame = next;
+		output->frame_time[next] = state->current_time;
+		if (output->valid_frames < 2) {
+			output->valid_frames++;
+		}
+	}
+	int newest = output->latest_frame;
+	/* until there are two frames, copy the only one */
+	int prev = output->valid_frames == 2 ? 1 - newest : newest;
+	float mix = 1.f;
+	if (output->valid_frames == 2) {
+		mix = (state->current_time - output->frame_time[newest]) /
+		      period;
+		mix = mix < 0.f ? 0.f : (mix > 1.f ? 1.f : mix);
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, target_fbo);
+	glViewport(0, 0, output->width, output->height);
+	gpu_timer_begin(state, &state->blend_timer);
+	glUseProgram(state->blend_prog);
+	glBindVertexArray(state->vertex_array);
+	glBindBuffer(GL_ARRAY_BUFFER, state->vertex_buffer);
+	glVertexAttribPointer(
+			state->attr_pos, 2, GL_FLOAT, GL_FALSE, 0, (void *)0);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, output->frames[prev].tex);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, output->frames[newest].tex);
+	glUniform1i(state->unif_blend_next, 0);
+	glUniform1i(state->unif_blend_prev, 1);
+	glUniform2f(state->unif_blend_size, (GLfloat)output->width,
+			(GLfloat)output->height);
+	glUniform1f(state->unif_blend_mix, mix);
 	glDrawArrays(GL_TRIANGLE_FAN, 0, 3);
+	gpu_timer_end(&state->blend_timer);
+}
+
+/* Shown while the shader is still being compiled */
+static void draw_placeholder(int width, int height)
+{
+	glViewport(0, 0, width, height);
+	glClearColor(0.f, 0.f, 0.f, 1.f);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glClearColor(0.f, 0.f, 0.f, 0.f);
+}
+
+/* Whether the output can take a new frame now. With --shm that needs a
+ * buffer the compositor has released, or a new pool after a resize. */
+static bool output_ready(struct output *output)
+{
+	if (!output->configured || output->frame_callback) {
+		return false;
+	}
+	return !output->state->use_shm || output->needs_resize ||
+	       shm_pool_acquire(output->shm_pool);
+}
+
+static void redraw(struct output *output)
+{
+	struct state *state = output->state;
+	if (state->use_shm) {
+		output->shm_buffer = shm_pool_acquire(output->shm_pool);
+		if (!output->shm_buffer) {
+			/* compositor holds every buffer; output_ready() waits
+			 * for a release before trying again */
+			return;
+		}
+	}
+	EGLSurface surface = state->use_shm ? EGL_NO_SURFACE
+					    : output->egl_surface;
+	TRACE_BEGIN(t_current);
+	if (!eglMakeCurrent(state->egl_display, surface, surface,
+			    state->egl_context)) {
+		fprintf(stderr, "Failed to make current\n");
+		exit(EXIT_FAILURE);
+	}
+	TRACE_END(t_current, "eglMakeCurrent", output->trace_track);
+	/* When rendering at reduced scale, draw into a smaller offscreen
+	 * buffer and stretch it over the window afterwards; the shader cost
+	 * falls with the pixel count. */
+	int width = output->width, height = output->height;
+	bool scaled = state->render_scale < 1.f;
+	if (scaled) {
+		width = (int)ceilf(width * state->render_scale);
+		height = (int)ceilf(height * state->render_scale);
+		width = width > 0 ? width : 1;
+		height = height > 0 ? height : 1;
+	}
+	/* the --render-fps blend writes the full-size frame itself */
+	bool interpolated = state->shader_ready && !state->vertex_count &&
+			    state->render_fps > 0;
+	GLuint target_fbo = 0;
+	if (state->use_shm && interpolated) {
+		ensure_render_target(&output->scaled, output->width,
+				output->height, state->format->internal_format);
+		target_fbo = output->scaled.fbo;
+	} else if (!interpolated && (scaled || state->use_shm)) {
+		ensure_render_target(&output->scaled, width, height,
+				state->format->internal_format);
+		target_fbo = output->scaled.fbo;
+	}
+	TRACE_BEGIN(t_draw);
+	if (state->shader_ready && state->vertex_count) {
+		draw_geometry(state, &output->accum, target_fbo, width, height);
+	} else if (interpolated) {
+		draw_interpolated(output, target_fbo, width, height);
+	} else if (state->shader_ready) {
+		draw_shader(state, output, width, height);
+	} else {
+		draw_placeholder(width, height);
+	}
+	TRACE_END(t_draw, "draw", output->trace_track);
+	if (state->use_shm) {
+		/* every pixel of the shader output may have changed */
+		shm_pool_damage(output->shm_pool, 0, 0, output->width,
+				output->height);
+		TRACE_BEGIN(t_read);
+		read_back_frame(output);
+		TRACE_END(t_read, "readback", output->trace_track);
+	} else if (scaled && !interpolated) {
+		TRACE_BEGIN(t_blit);
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, output->scaled.fbo);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+		glBlitFramebuffer(0, 0, width, height, 0, 0, output->width,
+				output->height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		TRACE_END(t_blit, "upscale", output->trace_track);
+	}
 	if (!check_gl_errors("drawing")) {
 		exit(EXIT_FAILURE);
 	}
 }
 
+static void log_startup_metrics(struct state *state)
+{
+	if (state->shown_first_real_frame) {
+		return;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	float elapsed = 1e-9f * (now.tv_nsec - state->launch_time.tv_nsec) +
+			1.f * (now.tv_sec - state->launch_time.tv_sec);
+	if (!state->shown_first_frame) {
+		state->shown_first_frame = true;
+		fprintf(stderr, "Startup: time to first frame %.3f s\n",
+				elapsed);
+	}
+	if (state->shader_ready) {
+		state->shown_first_real_frame = true;
+		fprintf(stderr, "Startup: time to first real frame %.3f s\n",
+				elapsed);
+	}
+}
+
+/* Request a frame callback and show the newly drawn frame */
+static void present(struct output *output)
+{
+	struct state *state = output->state;
+	if (state->use_shm) {
+		struct shm_buffer *buffer = output->shm_buffer;
+		if (!buffer) {
+			return;
+		}
+		log_startup_metrics(state);
+		TRACE_BEGIN(t_commit);
+		output->shm_buffer = NULL;
+		buffer->busy = true;
+		output->frame_callback = wl_surface_frame(output->surface);
+		wl_callback_add_listener(output->frame_callback,
+				&frame_callback_listener, output);
+		wl_surface_attach(output->surface, buffer->buffer, 0, 0);
+		wl_surface_damage_buffer(output->surface, 0, 0, output->width,
+				output->height);
+		wl_surface_commit(output->surface);
+		TRACE_END(t_commit, "commit", output->trace_track);
+		return;
+	}
+	log_startup_metrics(state);
+	TRACE_BEGIN(t_current);
+	if (!eglMakeCurrent(state->egl_display, output->egl_surface,
+			    output->egl_surface, state->egl_context)) {
+		fprintf(stderr, "Failed to make current\n");
+		exit(EXIT_FAILURE);
+	}
+	TRACE_END(t_current, "eglMakeCurrent", output->trace_track);
+	output->frame_callback = wl_surface_frame(output->surface);
+	wl_callback_add_listener(output->frame_callback,
+			&frame_callback_listener, output);
+	TRACE_BEGIN(t_swap);
+	if (!eglSwapBuffers(state->egl_display, output->egl_surface)) {
+		fprintf(stderr, "Failed to swap buffers\n");
+		exit(EXIT_FAILURE);
+	}
+	TRACE_END(t_swap, "eglSwapBuffers", output->trace_track);
+}
+
 static void layer_surface_configure(void *data,
 		struct zwlr_layer_surface_v1 *zwlr_layer_surface_v1,
 		uint32_t serial, uint32_t width, uint32_t height)
@@ -237,7 +1072,27 @@ static void layer_surface_configure(void *data,
 	if (height > 0) {
 		output->height = height;
 	}
-	if (!output->egl_window) {
+	state->canvas_dirty = true;
+	if (!output->configured && state->use_shm) {
+		output->configured = true;
+		zwlr_layer_surface_v1_ack_configure(
+				zwlr_layer_surface_v1, serial);
+		if (!state->has_shm_format) {
+			fprintf(stderr, "Compositor does not support wl_shm "
+					"buffers with format %s\n",
+					state->format->name);
+			exit(EXIT_FAILURE);
+		}
+		output->shm_pool = shm_pool_create(state->shm, output->width,
+				output->height, state->format->shm_format,
+				state->format->shm_bytes_per_pixel);
+		if (!output->shm_pool) {
+			exit(EXIT_FAILURE);
+		}
+		redraw(output);
+		present(output);
+	} else if (!output->configured) {
+		output->configured = true;
 		zwlr_layer_surface_v1_ack_configure(
 				zwlr_layer_surface_v1, serial);
 		output->egl_window = wl_egl_window_create(
@@ -260,13 +1115,7 @@ static void layer_surface_configure(void *data,
 			fprintf(stderr, "Failed to set swap interval\n");
 			exit(EXIT_FAILURE);
 		}
-		output->frame_callback = wl_surface_frame(output->surface);
-		wl_callback_add_listener(output->frame_callback,
-				&frame_callback_listener, output);
-		if (!eglSwapBuffers(state->egl_display, output->egl_surface)) {
-			fprintf(stderr, "Failed to swap buffers\n");
-			exit(EXIT_FAILURE);
-		}
+		present(output);
 	} else {
 		output->needs_ack = true;
 		output->needs_resize = true;
@@ -291,7 +1140,12 @@ static void output_geometry(void *data, struct wl_output *wl_output, int32_t x,
 		int32_t subpixel, const char *make, const char *model,
 		int32_t transform)
 {
-	// ignore
+	/* The transform needs no handling: the layer surface is configured
+	 * with the transformed (logical) size */
+	struct output *output = data;
+	output->x = x;
+	output->y = y;
+	output->state->canvas_dirty = true;
 }
 
 static void output_mode(void *data, struct wl_output *wl_output, uint32_t flags,
@@ -327,113 +1181,1302 @@ static void output_done(void *data, struct wl_output *wl_output)
 				output->layer_surface, -1);
 		zwlr_layer_surface_v1_add_listener(output->layer_surface,
 				&layer_surface_listener, output);
+		if (state->format->alpha_size == 0) {
+			/* The region is clipped to the surface, so this covers
+			 * all future sizes */
+			struct wl_region *region = wl_compositor_create_region(
+					state->compositor);
+			wl_region_add(region, 0, 0, INT32_MAX, INT32_MAX);
+			wl_surface_set_opaque_region(output->surface, region);
+			wl_region_destroy(region);
+		}
 		wl_surface_commit(output->surface);
 	}
 }
 
-static void output_scale(
-		void *data, struct wl_output *wl_output, int32_t factor)
+static void output_scale(
+		void *data, struct wl_output *wl_output, int32_t factor)
+{
+	// ignore
+}
+
+static void output_name(
+		void *data, struct wl_output *wl_output, const char *name)
+{
+	struct output *output = data;
+	free(output->str_name);
+	output->str_name = strdup(name);
+	TRACE_TRACK_NAME(output->trace_track, name);
+}
+
+static void output_description(void *data, struct wl_output *wl_output,
+		const char *description)
+{
+	// ignore
+}
+
+static const struct wl_output_listener output_listener = {
+		.geometry = output_geometry,
+		.mode = output_mode,
+		.done = output_done,
+		.scale = output_scale,
+		.name = output_name,
+		.description = output_description,
+};
+
+static void shm_format(void *data, struct wl_shm *wl_shm, uint32_t format)
+{
+	struct state *state = data;
+	if (format == state->format->shm_format) {
+		state->has_shm_format = true;
+	}
+}
+
+static const struct wl_shm_listener shm_listener = {
+		.format = shm_format,
+};
+
+static void registry_global(void *data, struct wl_registry *registry,
+		uint32_t name, const char *interface, uint32_t version)
+{
+	struct state *state = data;
+	if (strcmp(interface, wl_compositor_interface.name) == 0) {
+		state->compositor = wl_registry_bind(
+				registry, name, &wl_compositor_interface, 1);
+	} else if (strcmp(interface, wl_shm_interface.name) == 0) {
+		state->shm = wl_registry_bind(
+				registry, name, &wl_shm_interface, 1);
+		wl_shm_add_listener(state->shm, &shm_listener, state);
+	} else if (strcmp(interface, zwlr_layer_shell_v1_interface.name) == 0) {
+		state->layer_shell = wl_registry_bind(registry, name,
+				&zwlr_layer_shell_v1_interface, 1);
+	} else if (strcmp(interface, wl_output_interface.name) == 0 &&
+			version >= 4) {
+		/* we only accept version >= 4 outputs, as those provide their
+		 * name/description */
+		struct output *output = calloc(1, sizeof(struct output));
+		if (!output) {
+			fprintf(stderr, "Failed to allocate output\n");
+			return;
+		}
+		struct wl_output *wl_output = wl_registry_bind(
+				registry, name, &wl_output_interface, 4);
+		wl_output_add_listener(wl_output, &output_listener, output);
+		output->output = wl_output;
+		output->state = state;
+		output->output_name = name;
+		output->trace_track = ++state->next_trace_track;
+		wl_list_insert(&state->outputs, &output->link);
+	}
+}
+
+static void registry_global_remove(
+		void *data, struct wl_registry *registry, uint32_t name)
+{
+	struct state *state = data;
+	struct output *o, *tmp;
+	wl_list_for_each_safe(o, tmp, &state->outputs, link)
+	{
+		if (o->output_name == name) {
+			destroy_output(o);
+		}
+	}
+}
+
+static const struct wl_registry_listener registry_listener = {
+		registry_global, registry_global_remove};
+
+static float timespec_diff(struct timespec to, struct timespec from)
+{
+	return 1e-9f * (to.tv_nsec - from.tv_nsec) +
+	       1.f * (to.tv_sec - from.tv_sec);
+}
+
+static struct timespec fps_period(float fps)
+{
+	int64_t period_ns = (fps == INFINITY) ? 0 : (1e9f / fps);
+	struct timespec period;
+	period.tv_sec = period_ns / 1000000000;
+	period.tv_nsec = period_ns % 1000000000;
+	return period;
+}
+
+/* Combine the command line settings with the active power profile */
+static void apply_power_profile(struct state *state)
+{
+	const struct power_profile *profile = state->power.current;
+	state->fps = state->requested_fps;
+	state->render_scale = 1.f;
+	if (!state->power.enabled || !profile) {
+		return;
+	}
+	if (profile->fps < state->fps) {
+		state->fps = profile->fps;
+	}
+	state->render_scale = profile->render_scale;
+}
+
+static bool parse_positive(const char *arg, const char *what, float *out)
+{
+	char *endptr = NULL;
+	*out = strtof(arg, &endptr);
+	if (*endptr != '\0' || !(*out > 0)) {
+		fprintf(stderr, "Invalid %s '%s'\n", what, arg);
+		return false;
+	}
+	return true;
+}
+
+/* Size and length of the --bench-formats measurement */
+#define BENCH_WIDTH 1920
+#define BENCH_HEIGHT 1080
+#define BENCH_FRAMES 120
+
+/* Render the shader offscreen into each surface format, and print the mean
+ * time per frame. This covers shading and framebuffer write bandwidth; the
+ * compositor's savings from skipping blending of opaque surfaces come on
+ * top of this. */
+static void bench_frame(struct state *state, struct render_target *target,
+		struct render_target *accum)
+{
+	if (state->vertex_count) {
+		draw_geometry(state, accum, target->fbo, target->width,
+				target->height);
+	} else {
+		draw_shader(state, NULL, target->width, target->height);
+	}
+}
+
+/* Milliseconds per frame, rendering offscreen in the given format */
+static float bench_render(struct state *state, GLenum internal_format)
+{
+	struct render_target target = {0}, accum = {0};
+	ensure_render_target(&target, BENCH_WIDTH, BENCH_HEIGHT,
+			internal_format);
+	/* warm up, so shader compilation is not measured */
+	bench_frame(state, &target, &accum);
+	glFinish();
+
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int frame = 0; frame < BENCH_FRAMES; frame++) {
+		state->current_time = frame / 60.f;
+		state->delta_time = 1 / 60.f;
+		state->frame_no = frame;
+		bench_frame(state, &target, &accum);
+	}
+	glFinish();
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	destroy_render_target(&target);
+	destroy_render_target(&accum);
+	return 1e3f * timespec_diff(t1, t0) / BENCH_FRAMES;
+}
+
+static void bench_surface_formats(struct state *state)
+{
+	fprintf(stderr, "Rendering %d frames at %dx%d per format\n",
+			BENCH_FRAMES, BENCH_WIDTH, BENCH_HEIGHT);
+	for (size_t i = 0; i < NUM_SURFACE_FORMATS; i++) {
+		const struct surface_format *format = &surface_formats[i];
+		fprintf(stderr, "%-12s %8.3f ms/frame\n", format->name,
+				bench_render(state, format->internal_format));
+	}
+	check_gl_errors("benchmarking formats");
+}
+
+/* upper bound on STATE_SIZE, in vec4 slots */
+#define MAX_STATE_SIZE 1024
+
+/* milliseconds between checks whether the shader build has finished */
+#define SHADER_POLL_MS 5
+
+/* seconds between reports printed with --stats */
+#define STATS_INTERVAL 5.f
+
+static void report_pass(
+		const char *name, struct gpu_timer *timer, float elapsed)
+{
+	if (timer->timed) {
+		fprintf(stderr, "%s pass: %.1f/s, %.3f ms GPU time each\n",
+				name, timer->passes / elapsed,
+				1e3 * timer->seconds / timer->timed);
+	} else {
+		fprintf(stderr, "%s pass: %.1f/s\n", name,
+				timer->passes / elapsed);
+	}
+	timer->passes = timer->timed = 0;
+	timer->seconds = 0.;
+}
+
+static void report_stats(struct state *state, float elapsed)
+{
+	if (state->use_shm) {
+		struct shm_stats *st = &state->shm_stats;
+		fprintf(stderr,
+				"shm: %.1f frames/s, readback %.1f MB/s, %.2f "
+				"ms/frame copying\n",
+				st->frames / elapsed,
+				1e-6 * st->bytes_copied / elapsed,
+				st->frames ? 1e3 * st->copy_time / st->frames
+					   : 0.);
+		*st = (struct shm_stats){0};
+	}
+	if (state->tick_rate > 0) {
+		fprintf(stderr, "state: %.1f steps/s, %llu dropped\n",
+				state->ticks_run / elapsed,
+				(unsigned long long)state->ticks_dropped);
+		state->ticks_run = state->ticks_dropped = 0;
+	}
+	if (state->render_fps > 0) {
+		report_pass("shader", &state->shader_timer, elapsed);
+		report_pass("blend", &state->blend_timer, elapsed);
+	}
+
+	int bound = 0, shown = 0;
+	struct output *output;
+	wl_list_for_each(output, &state->outputs, link)
+	{
+		bound++;
+		shown += output->surface != NULL;
+	}
+	struct loop_stats *ls = &state->loop_stats;
+	double overhead = elapsed - ls->wait_time - ls->dispatch_time -
+			  ls->work_time;
+	fprintf(stderr,
+			"wayland: %d outputs (%d shown), %.1f events/s, "
+			"%.1f us to dispatch each\n",
+			bound, shown, ls->events / elapsed,
+			ls->events ? 1e6 * ls->dispatch_time / ls->events
+				   : 0.);
+	fprintf(stderr,
+			"main loop: %.1f iterations/s, %.1f us overhead "
+			"each\n",
+			ls->iterations / elapsed,
+			ls->iterations && overhead > 0
+					? 1e6 * overhead / ls->iterations
+					: 0.);
+	*ls = (struct loop_stats){0};
+}
+
+static const char vertex_shader_text[] =
+		"attribute vec2 pos;\n"
+		"void main() {\n"
+		"  gl_Position = vec4(pos.x, pos.y, 0, 1);\n"
+		"}\n";
+
+/* Uniforms of the image shader. The GLSL and SPIR-V builds both declare
+ * them from this table; as SPIR-V programs keep no uniform names, there
+ * each is declared at its index as location, and samplers have their
+ * texture unit as binding. The noise samplers follow. */
+struct image_uniform {
+	const char *type;
+	const char *name;
+	int unit; // for samplers
+};
+
+static const struct image_uniform image_uniforms[UNIF_NOISE] = {
+		[UNIF_RESOLUTION] = {"vec3", "iResolution", 0},
+		[UNIF_TIME] = {"float", "iTime", 0},
+		[UNIF_TIME_DELTA] = {"float", "iTimeDelta", 0},
+		[UNIF_FRAME] = {"float", "iFrame", 0},
+		[UNIF_MOUSE] = {"vec4", "iMouse", 0},
+		/* places the output within the canvas, with --span */
+		[UNIF_OFFSET] = {"vec2", "iOffset", 0},
+		/* only with --state */
+		[UNIF_STATE] = {"sampler2D", "iState", 0},
+};
+
+static const char frag_coda[] =
+		"void main() {\n"
+		"    mainImage(gl_FragColor, gl_FragCoord.xy + iOffset);\n"
+		"}\n";
+
+static const char *uniform_name(int i)
+{
+	return i < UNIF_NOISE ? image_uniforms[i].name
+			      : noise_textures[i - UNIF_NOISE].name;
+}
+
+/* Append the declaration of uniform i to decl; for SPIR-V, with its fixed
+ * location and binding */
+static void declare_uniform(char *decl, size_t size, bool spirv, int i)
+{
+	const char *type = "sampler2D";
+	int unit = NOISE_TEXTURE_UNIT + i - UNIF_NOISE;
+	if (i < UNIF_NOISE) {
+		type = image_uniforms[i].type;
+		unit = image_uniforms[i].unit;
+	} else if (noise_textures[i - UNIF_NOISE].depth > 1) {
+		type = "sampler3D";
+	}
+	size_t len = strlen(decl);
+	if (!spirv) {
+		snprintf(decl + len, size - len, "uniform %s %s;\n", type,
+				uniform_name(i));
+	} else if (strncmp(type, "sampler", 7)) {
+		snprintf(decl + len, size - len,
+				"layout(location = %d) uniform %s %s;\n", i,
+				type, uniform_name(i));
+	} else {
+		snprintf(decl + len, size - len,
+				"layout(location = %d, binding = %d) "
+				"uniform %s %s;\n",
+				i, unit, type, uniform_name(i));
+	}
+}
+
+/* Declare the uniforms the image shader can use: iState only with a
+ * simulation stage, and only the noise samplers it refers to */
+static void declare_uniforms(
+		const struct state *state, bool spirv, char *decl, size_t size)
+{
+	decl[0] = '\0';
+	for (int i = 0; i < NUM_UNIFORMS; i++) {
+		if (i == UNIF_STATE && !state->state_size) {
+			continue;
+		}
+		if (i >= UNIF_NOISE && !state->noise_tex[i - UNIF_NOISE]) {
+			continue;
+		}
+		declare_uniform(decl, size, spirv, i);
+	}
+}
+
+/* The same interface for SPIR-V builds (--spirv), in GLSL 4.50, after the
+ * uniform declarations */
+static const char spirv_frag_prologue[] =
+		"#version 450\n"
+		"#define texture2D texture\n"
+		"#define texture3D texture\n";
+
+static const char spirv_frag_coda[] =
+		"layout(location = 0) out vec4 shaderbg_FragColor;\n"
+		"void main() {\n"
+		"    mainImage(shaderbg_FragColor, gl_FragCoord.xy + iOffset);\n"
+		"}\n";
+
+/* a program is either all GLSL or all SPIR-V */
+static const char spirv_vertex_text[] =
+		"#version 450\n"
+		"layout(location = 0) in vec2 pos;\n"
+		"void main() {\n"
+		"  gl_Position = vec4(pos.x, pos.y, 0, 1);\n"
+		"}\n";
+
+/* In geometry mode, the shader implements
+ *   void mainVertex(out vec4 position, out vec4 color, in float vertexId)
+ * for vertexId = 0 .. iVertexCount - 1, and is wrapped as follows. It may
+ * also set gl_PointSize. */
+static const char geometry_prologue[] =
+		"uniform float iVertexCount;\n"
+		"attribute float vertexIdIn;\n"
+		"varying vec4 vColor;\n";
+
+static const char geometry_coda[] =
+		"void main() {\n"
+		"    vec4 position = vec4(0., 0., 0., 1.);\n"
+		"    vec4 color = vec4(1.);\n"
+		"    gl_PointSize = 1.;\n"
+		"    mainVertex(position, color, vertexIdIn);\n"
+		"    gl_Position = position;\n"
+		"    vColor = color;\n"
+		"}\n";
+
+static const char geometry_frag_text[] =
+		"varying vec4 vColor;\n"
+		"void main() {\n"
+		"    gl_FragColor = vColor;\n"
+		"}\n";
+
+/* Leaves the accumulated image alone, as far as blending is concerned */
+static const char fade_frag_text[] =
+		"void main() {\n"
+		"    gl_FragColor = vec4(0.);\n"
+		"}\n";
+
+/* Fills the frames between two renders with --render-fps */
+static const char blend_frag_text[] =
+		"uniform sampler2D prevFrame;\n"
+		"uniform sampler2D nextFrame;\n"
+		"uniform vec2 size;\n"
+		"uniform float mixFactor;\n"
+		"void main() {\n"
+		"    vec2 uv = gl_FragCoord.xy / size;\n"
+		"    gl_FragColor = mix(texture2D(prevFrame, uv),\n"
+		"            texture2D(nextFrame, uv), mixFactor);\n"
+		"}\n";
+
+/* upper bound for --geometry; vertex ids must be exact as floats */
+#define MAX_VERTEX_COUNT (1 << 24)
+
+/* Added after the uniforms (which then include iState) when a simulation
+ * stage is used, following the STATE_SIZE definition of the state shader */
+static const char state_prologue[] =
+		"vec4 getState(int i) {\n"
+		"    return texture2D(iState,\n"
+		"            vec2((float(i) + .5) / float(STATE_SIZE), .5));\n"
+		"}\n";
+
+/* The state source must define STATE_SIZE and the functions
+ *   void initState(inout vec4 s[STATE_SIZE])
+ *   void stepState(inout vec4 s[STATE_SIZE])
+ * which are wrapped as follows */
+static const char state_compute_prologue[] =
+		"#version 430\n"
+		"layout(local_size_x = 1) in;\n"
+		"layout(rgba32f, binding = 0) uniform image2D iStateImage;\n"
+		"uniform float iTime; "
+		"uniform float iTimeDelta; "
+		"uniform float iFrame;\n";
+
+static const char state_compute_coda[] =
+		"void main() {\n"
+		"    vec4 s[STATE_SIZE];\n"
+		"    for (int i = 0; i < STATE_SIZE; i++)\n"
+		"        s[i] = imageLoad(iStateImage, ivec2(i, 0));\n"
+		"    if (iFrame == 0.) initState(s); else stepState(s);\n"
+		"    for (int i = 0; i < STATE_SIZE; i++)\n"
+		"        imageStore(iStateImage, ivec2(i, 0), s[i]);\n"
+		"}\n";
+
+/* 1.20 is the first version allowing arrays as inout parameters */
+static const char state_frag_prologue[] =
+		"#version 120\n"
+		"uniform sampler2D iStatePrev;\n"
+		"uniform float iTime; "
+		"uniform float iTimeDelta; "
+		"uniform float iFrame;\n";
+
+/* every texel runs the full step, and keeps its own slot */
+static const char state_frag_coda[] =
+		"void main() {\n"
+		"    vec4 s[STATE_SIZE];\n"
+		"    for (int i = 0; i < STATE_SIZE; i++)\n"
+		"        s[i] = texture2D(iStatePrev,\n"
+		"                vec2((float(i) + .5) / float(STATE_SIZE), .5));\n"
+		"    if (iFrame == 0.) initState(s); else stepState(s);\n"
+		"    gl_FragColor = s[int(gl_FragCoord.x)];\n"
+		"}\n";
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_stop_signal(int sig) { stop_requested = 1; }
+
+/* Read a whole file into a null-terminated buffer */
+static char *read_file(const char *path)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		fprintf(stderr, "Failed to read shader file at '%s'\n", path);
+		return NULL;
+	}
+	fseek(file, 0, SEEK_END);
+	long len = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	char *text = (char *)malloc((size_t)len + 1); // +1 for null terminator
+	if (!text) {
+		fprintf(stderr, "Failed to allocate space to read shader file\n");
+		fclose(file);
+		return NULL;
+	}
+	fread(text, (size_t)len, 1, file);
+	text[len] = '\0'; // Null-terminate the string
+	fclose(file);
+	return text;
+}
+
+/* Compile a shader synchronously; returns 0 on failure */
+static GLuint compile_shader(GLenum type, const char **parts, int count,
+		const char *what)
+{
+	GLuint shader = glCreateShader(type);
+	glShaderSource(shader, count, parts, NULL);
+	glCompileShader(shader);
+	GLint glstatus;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &glstatus);
+	if (!glstatus) {
+		char log[1024] = {0};
+		GLsizei len;
+		glGetShaderInfoLog(shader, 1024, &len, log);
+		fprintf(stderr, "Failed to compile %s:\n%.*s\n", what, len,
+				log);
+		glDeleteShader(shader);
+		return 0;
+	}
+	return shader;
+}
+
+/* Link the given shaders, which are deleted; returns 0 on failure */
+static GLuint link_program(GLuint a, GLuint b, const char *what)
+{
+	GLuint prog = glCreateProgram();
+	glAttachShader(prog, a);
+	if (b) {
+		glAttachShader(prog, b);
+	}
+	glBindAttribLocation(prog, 0, "pos");
+	glLinkProgram(prog);
+	glDeleteShader(a);
+	if (b) {
+		glDeleteShader(b);
+	}
+	GLint glstatus;
+	glGetProgramiv(prog, GL_LINK_STATUS, &glstatus);
+	if (!glstatus) {
+		char log[1024] = {0};
+		GLsizei len;
+		glGetProgramInfoLog(prog, 1000, &len, log);
+		fprintf(stderr, "Failed to link %s:\n%.*s\n", what, len, log);
+		return 0;
+	}
+	return prog;
+}
+
+/* Start compiling the state program, along with the image shader */
+static void compile_state_program(struct state *state)
+{
+	if (!state->state_text) {
+		return;
+	}
+	GLuint *shaders = state->state_shaders;
+	if (state->state_compute) {
+		const char *parts[] = {state_compute_prologue,
+				state->state_text, state_compute_coda};
+		shaders[0] = glCreateShader(GL_COMPUTE_SHADER);
+		glShaderSource(shaders[0], 3, parts, NULL);
+		shaders[1] = 0;
+	} else {
+		const char *parts[] = {state_frag_prologue, state->state_text,
+				state_frag_coda};
+		const char *vtext = vertex_shader_text;
+		shaders[0] = glCreateShader(GL_FRAGMENT_SHADER);
+		glShaderSource(shaders[0], 3, parts, NULL);
+		shaders[1] = glCreateShader(GL_VERTEX_SHADER);
+		glShaderSource(shaders[1], 1, &vtext, NULL);
+	}
+	state->state_prog = glCreateProgram();
+	for (int i = 0; i < 2 && shaders[i]; i++) {
+		glCompileShader(shaders[i]);
+		glAttachShader(state->state_prog, shaders[i]);
+	}
+	glBindAttribLocation(state->state_prog, 0, "pos");
+	glLinkProgram(state->state_prog);
+}
+
+/* Issue compile and link commands, without waiting for their results */
+static void compile_and_link(struct state *state)
+{
+	state->frag_shader = glCreateShader(GL_FRAGMENT_SHADER);
+	state->vertex_shader = glCreateShader(GL_VERTEX_SHADER);
+	if (state->spirv_frag.words) {
+		/* report earlier errors, so only those of loading the
+		 * binaries are left to ignore below */
+		check_gl_errors("starting the shader build");
+		glShaderBinary(1, &state->frag_shader,
+				GL_SHADER_BINARY_FORMAT_SPIR_V_ARB,
+				state->spirv_frag.words,
+				(GLsizei)state->spirv_frag.size);
+		glSpecializeShader(state->frag_shader, "main", 0, NULL, NULL);
+		glShaderBinary(1, &state->vertex_shader,
+				GL_SHADER_BINARY_FORMAT_SPIR_V_ARB,
+				state->spirv_vert.words,
+				(GLsizei)state->spirv_vert.size);
+		glSpecializeShader(state->vertex_shader, "main", 0, NULL, NULL);
+		/* a binary the driver rejects raises GL_INVALID_VALUE or
+		 * GL_INVALID_OPERATION; the compile status reports it, and
+		 * we fall back to GLSL */
+		GLenum err;
+		while ((err = glGetError()) != GL_NO_ERROR) {
+			if (err != GL_INVALID_VALUE &&
+					err != GL_INVALID_OPERATION) {
+				fprintf(stderr, "GL error when loading SPIR-V: "
+						"%x\n",
+						err);
+			}
+		}
+	} else if (state->vertex_count) {
+		const char *vertex_parts[] = {
+				state->uniform_decl, // the same uniforms
+				geometry_prologue,
+				state->state_decl,
+				state->frag_text, // the user's vertex shader
+				geometry_coda,
+		};
+		glShaderSource(state->vertex_shader,
+				sizeof(vertex_parts) / sizeof(vertex_parts[0]),
+				vertex_parts, NULL);
+		const char *ftext = geometry_frag_text;
+		glShaderSource(state->frag_shader, 1, &ftext, NULL);
+	} else {
+		const char *frag_parts[] = {
+				state->uniform_decl, // no version
+				state->state_decl, // empty without --state
+				state->frag_text,
+				frag_coda,
+		};
+		glShaderSource(state->frag_shader,
+				sizeof(frag_parts) / sizeof(frag_parts[0]),
+				frag_parts, NULL);
+		const char *vtext = vertex_shader_text;
+		glShaderSource(state->vertex_shader, 1, &vtext, NULL);
+	}
+	if (!state->spirv_frag.words) {
+		glCompileShader(state->frag_shader);
+		glCompileShader(state->vertex_shader);
+	}
+
+	state->shader_prog = glCreateProgram();
+	glAttachShader(state->shader_prog, state->frag_shader);
+	glAttachShader(state->shader_prog, state->vertex_shader);
+	glBindAttribLocation(state->shader_prog, 0, "pos");
+	glBindAttribLocation(state->shader_prog, 0, "vertexIdIn");
+	glLinkProgram(state->shader_prog);
+}
+
+static bool have_gl_spirv(void)
+{
+	if (!glShaderBinary || !glSpecializeShader ||
+			!glGetProgramInterfaceiv || !glGetProgramResourceiv) {
+		return false;
+	}
+	const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+	return extensions && strstr(extensions, "GL_ARB_gl_spirv");
+}
+
+/* Compile the image shader to SPIR-V for --spirv, on a thread, as the
+ * tools take a while on the first run; without a binary, the build falls
+ * back to GLSL */
+static void *spirv_worker(void *data)
+{
+	struct state *state = data;
+	char uniform_decl[1024];
+	declare_uniforms(state, true, uniform_decl, sizeof(uniform_decl));
+	const char *frag_parts[] = {spirv_frag_prologue, uniform_decl,
+			state->state_decl, state->frag_text, spirv_frag_coda};
+	const char *vertex_parts[] = {spirv_vertex_text};
+	if (!spirv_compile("frag", frag_parts, 5, &state->spirv_frag) ||
+			!spirv_compile("vert", vertex_parts, 1,
+					&state->spirv_vert)) {
+		spirv_release(&state->spirv_frag);
+		spirv_release(&state->spirv_vert);
+		fprintf(stderr, "Falling back to GLSL\n");
+	}
+	atomic_store(&state->spirv_done, true);
+	return NULL;
+}
+
+static void *shader_worker(void *data)
+{
+	struct state *state = data;
+	if (!eglMakeCurrent(state->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+			    state->worker_context)) {
+		fprintf(stderr, "Failed to make worker context current\n");
+		exit(EXIT_FAILURE);
+	}
+	compile_state_program(state);
+	compile_and_link(state);
+	/* make the results visible to the main context */
+	glFinish();
+	eglMakeCurrent(state->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+			EGL_NO_CONTEXT);
+	atomic_store(&state->worker_done, true);
+	return NULL;
+}
+
+/* Start compiling and linking the program, from SPIR-V if there is a
+ * binary */
+static void start_program_build(struct state *state)
+{
+	const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+	if (glMaxShaderCompilerThreadsKHR && extensions &&
+			(strstr(extensions, "GL_KHR_parallel_shader_compile") ||
+					strstr(extensions,
+							"GL_ARB_parallel_shader_compile"))) {
+		state->parallel_compile = true;
+		glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+		compile_state_program(state);
+		compile_and_link(state);
+		return;
+	}
+
+	/* Otherwise, compile on a thread with its own context, sharing
+	 * objects with the main one */
+	EGLint context_attribs[] = {EGL_CONTEXT_MAJOR_VERSION, 2,
+			EGL_CONTEXT_MINOR_VERSION, 0, EGL_NONE};
+	state->worker_context = eglCreateContext(state->egl_display,
+			state->egl_config, state->egl_context, context_attribs);
+	atomic_store(&state->worker_done, false);
+	if (state->worker_context &&
+			pthread_create(&state->worker, NULL, shader_worker,
+					state) == 0) {
+		return;
+	}
+	fprintf(stderr, "Compiling shader synchronously\n");
+	if (state->worker_context) {
+		eglDestroyContext(state->egl_display, state->worker_context);
+		state->worker_context = EGL_NO_CONTEXT;
+	}
+	compile_state_program(state);
+	compile_and_link(state);
+}
+
+static void start_shader_build(struct state *state, char *frag_text)
+{
+	state->frag_text = frag_text;
+	declare_uniforms(state, false, state->uniform_decl,
+			sizeof(state->uniform_decl));
+	if (state->use_spirv && !have_gl_spirv()) {
+		fprintf(stderr, "GL_ARB_gl_spirv is not supported, using "
+				"GLSL\n");
+		state->use_spirv = false;
+	}
+	if (state->use_spirv) {
+		/* the program build starts once the tools are done */
+		atomic_store(&state->spirv_done, false);
+		if (pthread_create(&state->spirv_thread, NULL, spirv_worker,
+				    state) == 0) {
+			state->spirv_building = true;
+			return;
+		}
+		spirv_worker(state);
+	}
+	start_program_build(state);
+}
+
+/* Wait for the SPIR-V tools, and start building the program */
+static void join_spirv_worker(struct state *state)
+{
+	pthread_join(state->spirv_thread, NULL);
+	state->spirv_building = false;
+	start_program_build(state);
+}
+
+/* Whether the SPIR-V shaders were specialized and linked; prints the
+ * log if not */
+static bool spirv_program_ok(struct state *state)
+{
+	char log[1024] = {0};
+	GLsizei len = 0;
+	GLint glstatus;
+	GLuint shaders[] = {state->frag_shader, state->vertex_shader};
+	for (int i = 0; i < 2; i++) {
+		glGetShaderiv(shaders[i], GL_COMPILE_STATUS, &glstatus);
+		if (!glstatus) {
+			glGetShaderInfoLog(shaders[i], 1024, &len, log);
+			fprintf(stderr, "Failed to specialize SPIR-V shader:"
+					"\n%.*s\n",
+					len, log);
+			return false;
+		}
+	}
+	glGetProgramiv(state->shader_prog, GL_LINK_STATUS, &glstatus);
+	if (!glstatus) {
+		glGetProgramInfoLog(state->shader_prog, 1000, &len, log);
+		fprintf(stderr, "Failed to link SPIR-V shader:\n%.*s\n", len,
+				log);
+		return false;
+	}
+	return true;
+}
+
+/* Use the fixed uniform locations of SPIR-V programs, except where the
+ * uniform was optimized out (setting that would be an error) */
+static void set_spirv_uniform_locations(struct state *state)
+{
+	bool active[NUM_UNIFORMS] = {false};
+	GLint count = 0;
+	glGetProgramInterfaceiv(state->shader_prog, GL_UNIFORM,
+			GL_ACTIVE_RESOURCES, &count);
+	for (GLint i = 0; i < count; i++) {
+		const GLenum prop = GL_LOCATION;
+		GLint location = -1;
+		glGetProgramResourceiv(state->shader_prog, GL_UNIFORM,
+				(GLuint)i, 1, &prop, 1, NULL, &location);
+		if (location >= 0 && location < NUM_UNIFORMS) {
+			active[location] = true;
+		}
+	}
+	for (int i = 0; i < NUM_UNIFORMS; i++) {
+		state->unif[i] = active[i] ? i : -1;
+	}
+}
+
+/* Advance the simulation state by one step; the first step runs initState.
+ * Costs the same at any output resolution. */
+static void step_state(struct state *state)
+{
+	float time = state->current_time, delta = state->delta_time;
+	if (state->tick_rate > 0) {
+		delta = 1.f / state->tick_rate;
+		time = state->state_steps * delta;
+	}
+	glUseProgram(state->state_prog);
+	glUniform1f(state->unif_state_iTime, time);
+	glUniform1f(state->unif_state_iTimeDelta, delta);
+	glUniform1f(state->unif_state_iFrame, (float)state->state_steps);
+	if (state->state_compute) {
+		glBindImageTexture(0, state->state_tex[0], 0, GL_FALSE, 0,
+				GL_READ_WRITE, GL_RGBA32F);
+		glDispatchCompute(1, 1, 1);
+		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT |
+				GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+	} else {
+		int src = state->state_current, dst = 1 - src;
+		glBindFramebuffer(GL_FRAMEBUFFER, state->state_fbo[dst]);
+		glViewport(0, 0, state->state_size, 1);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, state->state_tex[src]);
+		glUniform1i(state->unif_state_prev, 0);
+		glBindVertexArray(state->vertex_array);
+		glBindBuffer(GL_ARRAY_BUFFER, state->vertex_buffer);
+		glVertexAttribPointer(state->attr_pos, 2, GL_FLOAT, GL_FALSE,
+				0, (void *)0);
+		glDrawArrays(GL_TRIANGLE_FAN, 0, 3);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		state->state_current = dst;
+	}
+	state->state_steps++;
+}
+
+/* Check the state program built along with the image shader, falling
+ * back to a fragment pass if the compute shader failed, and create the
+ * state textures. Runs initState. */
+static void finish_state_program(struct state *state)
+{
+	if (!state->state_text) {
+		return;
+	}
+	GLint compiled = GL_TRUE, linked = GL_FALSE;
+	for (int i = 0; i < 2 && state->state_shaders[i]; i++) {
+		GLint status;
+		glGetShaderiv(state->state_shaders[i], GL_COMPILE_STATUS,
+				&status);
+		if (!status) {
+			char log[1024] = {0};
+			GLsizei len;
+			glGetShaderInfoLog(state->state_shaders[i], 1024, &len,
+					log);
+			fprintf(stderr, "Failed to compile state shader:\n"
+					"%.*s\n",
+					len, log);
+			compiled = GL_FALSE;
+		}
+		glDeleteShader(state->state_shaders[i]);
+	}
+	glGetProgramiv(state->state_prog, GL_LINK_STATUS, &linked);
+	if (compiled && !linked) {
+		char log[1024] = {0};
+		GLsizei len;
+		glGetProgramInfoLog(state->state_prog, 1000, &len, log);
+		fprintf(stderr, "Failed to link state shader:\n%.*s\n", len,
+				log);
+	}
+	if ((!compiled || !linked) && state->state_compute) {
+		fprintf(stderr, "Falling back to fragment pass for state\n");
+		glDeleteProgram(state->state_prog);
+		state->state_compute = false;
+		const char *parts[] = {state_frag_prologue, state->state_text,
+				state_frag_coda};
+		const char *vtext = vertex_shader_text;
+		GLuint fs = compile_shader(GL_FRAGMENT_SHADER, parts, 3,
+				"state fragment shader");
+		GLuint vs = compile_shader(
+				GL_VERTEX_SHADER, &vtext, 1, "vertex shader");
+		state->state_prog = fs && vs ? link_program(
+							       fs, vs, "state shader")
+					     : 0;
+	} else if (!compiled || !linked) {
+		state->state_prog = 0;
+	}
+	if (!state->state_prog) {
+		exit(EXIT_FAILURE);
+	}
+	free(state->state_text);
+	state->state_text = NULL;
+
+	fprintf(stderr, "State stage: %d slots, stepped by %s\n",
+			state->state_size,
+			state->state_compute ? "compute shader"
+					     : "fragment pass");
+	state->unif_state_iTime =
+			glGetUniformLocation(state->state_prog, "iTime");
+	state->unif_state_iTimeDelta =
+			glGetUniformLocation(state->state_prog, "iTimeDelta");
+	state->unif_state_iFrame =
+			glGetUniformLocation(state->state_prog, "iFrame");
+	state->unif_state_prev =
+			glGetUniformLocation(state->state_prog, "iStatePrev");
+
+	GLfloat zeros[MAX_STATE_SIZE * 4] = {0};
+	int count = state->state_compute ? 1 : 2;
+	glGenTextures(count, state->state_tex);
+	for (int i = 0; i < count; i++) {
+		glBindTexture(GL_TEXTURE_2D, state->state_tex[i]);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, state->state_size, 1,
+				0, GL_RGBA, GL_FLOAT, zeros);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+				GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER,
+				GL_NEAREST);
+	}
+	if (!state->state_compute) {
+		glGenFramebuffers(2, state->state_fbo);
+		for (int i = 0; i < 2; i++) {
+			glBindFramebuffer(GL_FRAMEBUFFER, state->state_fbo[i]);
+			glFramebufferTexture2D(GL_FRAMEBUFFER,
+					GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+					state->state_tex[i], 0);
+			if (glCheckFramebufferStatus(GL_FRAMEBUFFER) !=
+					GL_FRAMEBUFFER_COMPLETE) {
+				fprintf(stderr, "Float framebuffers are not "
+						"supported\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+	/* run initState */
+	step_state(state);
+	if (!check_gl_errors("setting up state stage")) {
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Check the results of a completed build, and look up uniforms */
+static void finish_shader_build(struct state *state)
+{
+	if (state->spirv_building) {
+		join_spirv_worker(state);
+	}
+	if (state->worker_context) {
+		pthread_join(state->worker, NULL);
+		eglDestroyContext(state->egl_display, state->worker_context);
+		state->worker_context = EGL_NO_CONTEXT;
+	}
+	finish_state_program(state);
+	if (state->spirv_frag.words && !spirv_program_ok(state)) {
+		fprintf(stderr, "Falling back to GLSL\n");
+		glDeleteProgram(state->shader_prog);
+		glDeleteShader(state->frag_shader);
+		glDeleteShader(state->vertex_shader);
+		spirv_release(&state->spirv_frag);
+		spirv_release(&state->spirv_vert);
+		compile_and_link(state);
+	}
+	free(state->frag_text);
+	state->frag_text = NULL;
+
+	GLint glstatus;
+	glGetShaderiv(state->frag_shader, GL_COMPILE_STATUS, &glstatus);
+	if (!glstatus) {
+		char log[1024] = {0};
+		GLsizei len;
+		glGetShaderInfoLog(state->frag_shader, 1024, &len, log);
+		fprintf(stderr, "Failed to compile fragment shader:\n%.*s\n",
+				len, log);
+		exit(EXIT_FAILURE);
+	}
+	glGetShaderiv(state->vertex_shader, GL_COMPILE_STATUS, &glstatus);
+	if (!glstatus) {
+		char log[1024] = {0};
+		GLsizei len;
+		glGetShaderInfoLog(state->vertex_shader, 1024, &len, log);
+		fprintf(stderr, "Failed to compile vertex shader:\n%.*s\n", len,
+				log);
+		exit(EXIT_FAILURE);
+	}
+	glGetProgramiv(state->shader_prog, GL_LINK_STATUS, &glstatus);
+	if (!glstatus) {
+		char log[1024] = {0};
+		GLsizei len;
+		glGetProgramInfoLog(state->shader_prog, 1000, &len, log);
+		fprintf(stderr, "Failed to link shader:\n%.*s\n", len, log);
+		exit(1);
+	}
+	glDeleteShader(state->frag_shader);
+	glDeleteShader(state->vertex_shader);
+
+	for (int i = 0; i < NUM_UNIFORMS; i++) {
+		state->unif[i] = glGetUniformLocation(
+				state->shader_prog, uniform_name(i));
+	}
+	state->unif_iVertexCount = glGetUniformLocation(
+			state->shader_prog, "iVertexCount");
+	if (state->spirv_frag.words) {
+		set_spirv_uniform_locations(state);
+	}
+	if (!check_gl_errors("loading shaders")) {
+		exit(EXIT_FAILURE);
+	}
+	state->shader_ready = true;
+}
+
+/* Returns true once the shader can be used, without blocking */
+static bool shader_build_done(struct state *state)
+{
+	if (state->shader_ready) {
+		return true;
+	}
+	if (state->spirv_building) {
+		if (atomic_load(&state->spirv_done)) {
+			join_spirv_worker(state);
+		}
+		return false;
+	}
+	if (state->worker_context) {
+		if (!atomic_load(&state->worker_done)) {
+			return false;
+		}
+	} else if (state->parallel_compile) {
+		GLint done = GL_FALSE;
+		glGetProgramiv(state->shader_prog, GL_COMPLETION_STATUS_KHR,
+				&done);
+		if (done && state->state_text) {
+			glGetProgramiv(state->state_prog,
+					GL_COMPLETION_STATUS_KHR, &done);
+		}
+		if (!done) {
+			return false;
+		}
+	}
+	finish_shader_build(state);
+	return true;
+}
+
+static void wait_for_shader_build(struct state *state)
+{
+	/* joining the worker and the status queries block until the build
+	 * is complete */
+	if (!state->shader_ready) {
+		finish_shader_build(state);
+	}
+}
+
+/* Time the built program, then delete it; its shaders were flagged for
+ * deletion when it was linked, so they go with it */
+static void bench_build(struct state *state, const char *name)
 {
-	// ignore
+	fprintf(stderr, "%-12s %8.3f ms/frame\n", name,
+			bench_render(state, GL_RGBA8));
+	glUseProgram(0);
+	glDeleteProgram(state->shader_prog);
+	state->shader_prog = 0;
+	state->shader_ready = false;
 }
 
-static void output_name(
-		void *data, struct wl_output *wl_output, const char *name)
+/* For --bench-spirv: time the current (SPIR-V) program, then rebuild the
+ * shader from frag_text as GLSL and time that */
+static void bench_shader_builds(struct state *state, char *frag_text)
 {
-	struct output *output = data;
-	free(output->str_name);
-	output->str_name = strdup(name);
+	fprintf(stderr, "Rendering %d frames at %dx%d per build\n",
+			BENCH_FRAMES, BENCH_WIDTH, BENCH_HEIGHT);
+	wait_for_shader_build(state);
+	if (!state->spirv_frag.words) {
+		fprintf(stderr, "No SPIR-V build to compare with\n");
+		bench_build(state, "GLSL");
+		free(frag_text);
+		return;
+	}
+	bench_build(state, "SPIR-V");
+	spirv_release(&state->spirv_frag);
+	spirv_release(&state->spirv_vert);
+	state->use_spirv = false;
+
+	start_shader_build(state, frag_text);
+	wait_for_shader_build(state);
+	bench_build(state, "GLSL");
+	check_gl_errors("benchmarking builds");
 }
 
-static void output_description(void *data, struct wl_output *wl_output,
-		const char *description)
+static bool have_compute_shaders(void)
 {
-	// ignore
+	if (!glDispatchCompute || !glBindImageTexture || !glMemoryBarrier) {
+		return false;
+	}
+	GLint major = 0, minor = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &major);
+	glGetIntegerv(GL_MINOR_VERSION, &minor);
+	return major > 4 || (major == 4 && minor >= 3);
 }
 
-static const struct wl_output_listener output_listener = {
-		.geometry = output_geometry,
-		.mode = output_mode,
-		.done = output_done,
-		.scale = output_scale,
-		.name = output_name,
-		.description = output_description,
-};
-
-static void registry_global(void *data, struct wl_registry *registry,
-		uint32_t name, const char *interface, uint32_t version)
+static bool have_timer_queries(void)
 {
-	struct state *state = data;
-	if (strcmp(interface, wl_compositor_interface.name) == 0) {
-		state->compositor = wl_registry_bind(
-				registry, name, &wl_compositor_interface, 1);
-	} else if (strcmp(interface, zwlr_layer_shell_v1_interface.name) == 0) {
-		state->layer_shell = wl_registry_bind(registry, name,
-				&zwlr_layer_shell_v1_interface, 1);
-	} else if (strcmp(interface, wl_output_interface.name) == 0 &&
-			version >= 4) {
-		/* we only accept version >= 4 outputs, as those provide their
-		 * name/description */
-		struct output *output = calloc(1, sizeof(struct output));
-		if (!output) {
-			fprintf(stderr, "Failed to allocate output\n");
-			return;
-		}
-		struct wl_output *wl_output = wl_registry_bind(
-				registry, name, &wl_output_interface, 4);
-		wl_output_add_listener(wl_output, &output_listener, output);
-		output->output = wl_output;
-		output->state = state;
-		output->output_name = name;
-		wl_list_insert(&state->outputs, &output->link);
+	if (!glGenQueries || !glBeginQuery || !glEndQuery ||
+			!glGetQueryObjectiv || !glGetQueryObjectui64v) {
+		return false;
 	}
+	GLint major = 0, minor = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &major);
+	glGetIntegerv(GL_MINOR_VERSION, &minor);
+	const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+	return major > 3 || (major == 3 && minor >= 3) ||
+	       (extensions && strstr(extensions, "GL_ARB_timer_query"));
 }
 
-static void registry_global_remove(
-		void *data, struct wl_registry *registry, uint32_t name)
+/* Upload the noise textures that the shader refers to; the rest are
+ * neither generated, bound nor declared */
+static bool setup_noise_textures(struct state *state, const char *shader_text)
 {
-	struct state *state = data;
-	struct output *o, *tmp;
-	wl_list_for_each_safe(o, tmp, &state->outputs, link)
-	{
-		if (o->output_name == name) {
-			destroy_output(o);
+	for (int i = 0; i < NUM_NOISE_TEXTURES; i++) {
+		const struct noise_texture *tex = &noise_textures[i];
+		if (!strstr(shader_text, tex->name)) {
+			continue;
+		}
+		struct noise_data data;
+		if (!noise_load(tex, &data)) {
+			return false;
+		}
+		GLenum format = tex->channels == 1 ? GL_LUMINANCE : GL_RGBA;
+		GLenum internal_format =
+				tex->channels == 1 ? GL_LUMINANCE8 : GL_RGBA8;
+		GLenum target = tex->depth > 1 ? GL_TEXTURE_3D : GL_TEXTURE_2D;
+		glGenTextures(1, &state->noise_tex[i]);
+		glBindTexture(target, state->noise_tex[i]);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		if (tex->depth > 1) {
+			glTexImage3D(target, 0, internal_format, tex->width,
+					tex->height, tex->depth, 0, format,
+					GL_UNSIGNED_BYTE, data.texels);
+			glTexParameteri(target, GL_TEXTURE_WRAP_R, GL_REPEAT);
+		} else {
+			glTexImage2D(target, 0, internal_format, tex->width,
+					tex->height, 0, format,
+					GL_UNSIGNED_BYTE, data.texels);
 		}
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		noise_release(&data);
+		glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glBindTexture(GL_TEXTURE_3D, 0);
+	return check_gl_errors("uploading noise textures");
 }
 
-static const struct wl_registry_listener registry_listener = {
-		registry_global, registry_global_remove};
-
-static float timespec_diff(struct timespec to, struct timespec from)
+/* Compile the program blending frames for --render-fps */
+static bool setup_interpolation(struct state *state)
 {
-	return 1e-9f * (to.tv_nsec - from.tv_nsec) +
-	       1.f * (to.tv_sec - from.tv_sec);
+	const char *vtext = vertex_shader_text, *ftext = blend_frag_text;
+	GLuint vs = compile_shader(
+			GL_VERTEX_SHADER, &vtext, 1, "vertex shader");
+	GLuint fs = compile_shader(
+			GL_FRAGMENT_SHADER, &ftext, 1, "blend shader");
+	if (!vs || !fs) {
+		return false;
+	}
+	state->blend_prog = link_program(fs, vs, "blend shader");
+	if (!state->blend_prog) {
+		return false;
+	}
+	state->unif_blend_prev =
+			glGetUniformLocation(state->blend_prog, "prevFrame");
+	state->unif_blend_next =
+			glGetUniformLocation(state->blend_prog, "nextFrame");
+	state->unif_blend_size =
+			glGetUniformLocation(state->blend_prog, "size");
+	state->unif_blend_mix =
+			glGetUniformLocation(state->blend_prog, "mixFactor");
+	state->has_timer_queries = have_timer_queries();
+	return check_gl_errors("setting up interpolation");
 }
 
-static const char vertex_shader_text[] =
-		"attribute vec2 pos;\n"
-		"void main() {\n"
-		"  gl_Position = vec4(pos.x, pos.y, 0, 1);\n"
-		"}\n";
+/* Create the vertex ids and the program fading the accumulated geometry */
+static bool setup_geometry(struct state *state)
+{
+	GLfloat *ids = malloc(sizeof(GLfloat) * state->vertex_count);
+	if (!ids) {
+		fprintf(stderr, "Failed to allocate vertex ids\n");
+		return false;
+	}
+	for (GLsizei i = 0; i < state->vertex_count; i++) {
+		ids[i] = (GLfloat)i;
+	}
+	glGenBuffers(1, &state->vertex_id_buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, state->vertex_id_buffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * state->vertex_count,
+			ids, GL_STATIC_DRAW);
+	free(ids);
+
+	const char *vtext = vertex_shader_text, *ftext = fade_frag_text;
+	GLuint vs = compile_shader(
+			GL_VERTEX_SHADER, &vtext, 1, "vertex shader");
+	GLuint fs = compile_shader(
+			GL_FRAGMENT_SHADER, &ftext, 1, "fade shader");
+	if (!vs || !fs) {
+		return false;
+	}
+	state->fade_prog = link_program(fs, vs, "fade shader");
+	if (!state->fade_prog) {
+		return false;
+	}
+	/* let mainVertex set gl_PointSize */
+	glEnable(GL_PROGRAM_POINT_SIZE);
+	return check_gl_errors("setting up geometry");
+}
 
-/* *** FIX: Reverted to the original prologue without #version *** */
-static const char frag_prologue[] = "uniform vec3 iResolution; "
-				    "uniform float iTime; "
-				    "uniform float iTimeDelta; "
-				    "uniform float iFrame; "
-				    "uniform vec4 iMouse;\n";
+/* Read the simulation stage's size and choose how to step it; the
+ * program and state textures are set up when the shader build finishes.
+ * The state starts out as all zeros, before initState runs on the first
+ * step. */
+static bool setup_state_stage(struct state *state)
+{
+	const char *def = strstr(state->state_text, "#define STATE_SIZE");
+	if (def) {
+		state->state_size = (int)strtol(
+				def + strlen("#define STATE_SIZE"), NULL, 10);
+	}
+	if (state->state_size < 1 || state->state_size > MAX_STATE_SIZE) {
+		fprintf(stderr, "State shader must '#define STATE_SIZE n', with "
+				"0 < n <= %d\n",
+				MAX_STATE_SIZE);
+		return false;
+	}
+	snprintf(state->state_decl, sizeof(state->state_decl),
+			"#define STATE_SIZE %d\n%s", state->state_size,
+			state_prologue);
+
+	/* the program is built with the image shader, and falls back to a
+	 * fragment pass if the compute shader fails */
+	state->state_compute = state->allow_compute && have_compute_shaders();
+	return true;
+}
 
-static const char frag_coda[] =
-		"void main() {\n"
-		"    mainImage(gl_FragColor, gl_FragCoord.xy);\n"
-		"}\n";
+/* Number of state steps to run for a frame advancing delta_time */
+static int state_steps_due(struct state *state)
+{
+	if (state->tick_rate <= 0) {
+		return 1;
+	}
+	state->tick_debt += state->delta_time * state->tick_rate;
+	int due = (int)state->tick_debt;
+	state->tick_debt -= due;
+	if (due > state->max_substeps) {
+		state->ticks_dropped += due - state->max_substeps;
+		due = state->max_substeps;
+	}
+	state->ticks_run += due;
+	return due;
+}
 
 int main(int argc, char **argv)
 {
 	struct state state = {0};
+	clock_gettime(CLOCK_MONOTONIC, &state.launch_time);
 	state.fps = INFINITY;
 	state.speed = 1.f;
+	state.render_scale = 1.f;
+	state.format = &surface_formats[0];
+	state.allow_compute = true;
+	state.primitive = GL_POINTS;
+	state.fade = .5f;
+	state.max_substeps = 16;
+	power_policy_init(&state.power);
+	bool bench_formats = false;
+	bool bench_spirv = false;
+	const char *trace_path = NULL;
 	state.layer = ZWLR_LAYER_SHELL_V1_LAYER_BACKGROUND;
 	wl_list_init(&state.outputs);
 
@@ -443,11 +2486,30 @@ int main(int argc, char **argv)
 			break;
 		}
 		switch (opt) {
-		case 'h':
+		case 'h': {
 			fprintf(stdout, "%s", usage);
-			fprintf(stdout, "\nPrefix:\n\n%s", frag_prologue);
+			char decl[1024];
+			declare_uniforms(&state, false, decl, sizeof(decl));
+			fprintf(stdout, "\nPrefix:\n\n%s", decl);
+			decl[0] = '\0';
+			for (int i = UNIF_NOISE; i < NUM_UNIFORMS; i++) {
+				declare_uniform(decl, sizeof(decl), false, i);
+			}
+			fprintf(stdout, "\nAdded to prefix if the shader uses "
+					"them:\n\n%s",
+					decl);
 			fprintf(stdout, "\nSuffix:\n\n%s", frag_coda);
+			decl[0] = '\0';
+			declare_uniform(decl, sizeof(decl), false, UNIF_STATE);
+			fprintf(stdout, "\nAdded to prefix with --state:\n\n%s%s",
+					decl, state_prologue);
+			fprintf(stdout, "\nAdded to prefix with --geometry:"
+					"\n\n%s",
+					geometry_prologue);
+			fprintf(stdout, "\nSuffix with --geometry:\n\n%s",
+					geometry_coda);
 			return EXIT_SUCCESS;
+		}
 		case 'f': {
 			char *endptr = NULL;
 			state.fps = strtof(optarg, &endptr);
@@ -483,6 +2545,146 @@ int main(int argc, char **argv)
 				return EXIT_FAILURE; // Added return here
 			}
 			break;
+		case OPT_NO_POWER_POLICY:
+			state.power.enabled = false;
+			break;
+		case OPT_BATTERY_FPS:
+			if (!parse_positive(optarg, "battery fps",
+					    &state.power.battery.fps)) {
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_BATTERY_SCALE:
+			if (!parse_positive(optarg, "battery scale",
+					    &state.power.battery.render_scale) ||
+					state.power.battery.render_scale > 1.f) {
+				fprintf(stderr, "Battery scale must be in (0,1]\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_THROTTLE_TEMP:
+			if (!parse_positive(optarg, "throttle temperature",
+					    &state.power.throttle_temp)) {
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_PAUSE_TEMP:
+			if (!parse_positive(optarg, "pause temperature",
+					    &state.power.pause_temp)) {
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_POWER_SUPPLY_DIR:
+			state.power.power_supply_dir = optarg;
+			break;
+		case OPT_THERMAL_DIR:
+			state.power.thermal_dir = optarg;
+			break;
+		case OPT_SHM:
+			state.use_shm = true;
+			break;
+		case OPT_STATS:
+			state.print_stats = true;
+			break;
+		case OPT_FORMAT:
+			state.format = NULL;
+			for (size_t i = 0; i < NUM_SURFACE_FORMATS; i++) {
+				if (!strcmp(optarg, surface_formats[i].name)) {
+					state.format = &surface_formats[i];
+				}
+			}
+			if (!state.format) {
+				fprintf(stderr, "Invalid format '%s'\n",
+						optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_BENCH_FORMATS:
+			bench_formats = true;
+			break;
+		case OPT_SPIRV:
+			state.use_spirv = true;
+			break;
+		case OPT_BENCH_SPIRV:
+			state.use_spirv = true;
+			bench_spirv = true;
+			break;
+		case OPT_STATE:
+			state.state_path = optarg;
+			break;
+		case OPT_NO_COMPUTE:
+			state.allow_compute = false;
+			break;
+		case OPT_GEOMETRY: {
+			char *endptr = NULL;
+			long count = strtol(optarg, &endptr, 10);
+			if (*endptr != '\0' || count < 1 ||
+					count > MAX_VERTEX_COUNT) {
+				fprintf(stderr, "Invalid vertex count '%s'\n",
+						optarg);
+				return EXIT_FAILURE;
+			}
+			state.vertex_count = (GLsizei)count;
+		} break;
+		case OPT_PRIMITIVE:
+			if (!strcmp(optarg, "points")) {
+				state.primitive = GL_POINTS;
+			} else if (!strcmp(optarg, "lines")) {
+				state.primitive = GL_LINES;
+			} else if (!strcmp(optarg, "line-strip")) {
+				state.primitive = GL_LINE_STRIP;
+			} else {
+				fprintf(stderr,
+						"Invalid primitive '%s'; "
+						"should be one of 'points', "
+						"'lines', 'line-strip'\n",
+						optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_TICK_RATE:
+			if (!parse_positive(optarg, "tick rate",
+					    &state.tick_rate)) {
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_SPAN:
+			state.span = true;
+			break;
+		case OPT_RENDER_FPS:
+			if (!parse_positive(optarg, "render fps",
+					    &state.render_fps)) {
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_MAX_SUBSTEPS: {
+			char *endptr = NULL;
+			long max = strtol(optarg, &endptr, 10);
+			if (*endptr != '\0' || max < 1 || max > 1000) {
+				fprintf(stderr, "Invalid max substeps '%s'\n",
+						optarg);
+				return EXIT_FAILURE;
+			}
+			state.max_substeps = (int)max;
+		} break;
+		case OPT_FADE: {
+			char *endptr = NULL;
+			state.fade = strtof(optarg, &endptr);
+			if (*endptr != '\0' ||
+					!(state.fade >= 0 && state.fade < 1)) {
+				fprintf(stderr, "Fade must be in [0,1)\n");
+				return EXIT_FAILURE;
+			}
+		} break;
+		case OPT_TRACE:
+#ifdef SHADERBG_TRACE
+			trace_path = optarg;
+			break;
+#else
+			fprintf(stderr, "shaderbg was built without tracing "
+					"support\n");
+			return EXIT_FAILURE;
+#endif
 		default:
 			fprintf(stdout, "%s", usage);
 			return EXIT_FAILURE;
@@ -493,8 +2695,39 @@ int main(int argc, char **argv)
 		fprintf(stdout, "%s", usage);
 		return EXIT_FAILURE;
 	}
+	if (state.span && state.vertex_count) {
+		fprintf(stderr, "--span does not apply to --geometry\n");
+		return EXIT_FAILURE;
+	}
+	if (state.render_fps > 0 && state.vertex_count) {
+		fprintf(stderr, "--render-fps does not apply to --geometry\n");
+		return EXIT_FAILURE;
+	}
+	if (state.use_spirv && state.vertex_count) {
+		fprintf(stderr, "--spirv does not apply to --geometry\n");
+		return EXIT_FAILURE;
+	}
+	if (state.tick_rate > 0 && !state.state_path) {
+		fprintf(stderr, "--tick-rate needs a simulation stage "
+				"(--state)\n");
+		return EXIT_FAILURE;
+	}
 	state.output_name = argv[optind];
 	state.shader_path = argv[optind + 1];
+	state.requested_fps = state.fps;
+
+	if (trace_path) {
+#ifdef SHADERBG_TRACE
+		if (!trace_start(trace_path)) {
+			return EXIT_FAILURE;
+		}
+#endif
+		/* stop cleanly on ^C, so the trace file is complete */
+		struct sigaction sa = {0};
+		sa.sa_handler = handle_stop_signal;
+		sigaction(SIGINT, &sa, NULL);
+		sigaction(SIGTERM, &sa, NULL);
+	}
 
 	fprintf(stderr,
 			"Running shaderbg with output = '%s' shader = '%s' fps = %f "
@@ -502,20 +2735,31 @@ int main(int argc, char **argv)
 			state.output_name, state.shader_path, state.fps,
 			state.layer);
 
-	state.display = wl_display_connect(NULL);
-	if (!state.display) {
-		fprintf(stderr, "Failed to connect to Wayland display\n");
-		return EXIT_FAILURE;
-	}
+	/* The benchmarks only render offscreen, through the surfaceless
+	 * display of the wl_shm path, so they run without a compositor */
+	bool headless = bench_formats || bench_spirv;
+	if (headless) {
+		state.use_shm = true;
+	} else {
+		state.display = wl_display_connect(NULL);
+		if (!state.display) {
+			fprintf(stderr, "Failed to connect to Wayland "
+					"display\n");
+			return EXIT_FAILURE;
+		}
 
-	state.registry = wl_display_get_registry(state.display);
-	wl_registry_add_listener(state.registry, &registry_listener, &state);
+		state.registry = wl_display_get_registry(state.display);
+		wl_registry_add_listener(
+				state.registry, &registry_listener, &state);
 
-	wl_display_roundtrip(state.display); // Initial roundtrip to get globals
+		// Initial roundtrip to get globals
+		wl_display_roundtrip(state.display);
 
-	if (!state.compositor || !state.layer_shell) {
-		fprintf(stderr, "Missing Wayland compositor or layer shell\n");
-		return EXIT_FAILURE;
+		if (!state.compositor || !state.layer_shell) {
+			fprintf(stderr, "Missing Wayland compositor or layer "
+					"shell\n");
+			return EXIT_FAILURE;
+		}
 	}
 
 	const char *extensions_list =
@@ -539,15 +2783,35 @@ int main(int argc, char **argv)
 								       // extensions_list
 		has_khr_platform = true;
 	}
-	if (!has_khr_platform && !has_ext_platform) {
-		fprintf(stderr, "No EGL Wayland platform extension found\n");
+	if (!has_khr_platform && !has_ext_platform && !state.use_shm) {
+		fprintf(stderr, "No EGL Wayland platform extension found, "
+				"falling back to wl_shm output\n");
+		state.use_shm = true;
+	}
+	if (state.use_shm && !state.shm && !headless) {
+		fprintf(stderr, "Missing Wayland wl_shm\n");
 		return EXIT_FAILURE;
 	}
 
 	PFNEGLGETPLATFORMDISPLAYEXTPROC eglGetPlatformDisplay =
 			NULL; // Use the one type that is known to exist
 
-	if (has_ext_platform) {
+	if (state.use_shm) {
+		/* Render without any window system; llvmpipe or a GPU render
+		 * node both work */
+		eglGetPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+				eglGetProcAddress("eglGetPlatformDisplayEXT");
+		if (eglGetPlatformDisplay && extensions_list &&
+				strstr(extensions_list,
+						"EGL_MESA_platform_surfaceless")) {
+			state.egl_display = eglGetPlatformDisplay(
+					EGL_PLATFORM_SURFACELESS_MESA,
+					EGL_DEFAULT_DISPLAY, NULL);
+		}
+		if (state.egl_display == EGL_NO_DISPLAY) {
+			state.egl_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+		}
+	} else if (has_ext_platform) {
 		eglGetPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)
 				eglGetProcAddress("eglGetPlatformDisplayEXT");
 		if (eglGetPlatformDisplay) {
@@ -558,7 +2822,8 @@ int main(int argc, char **argv)
 	}
 
 	// Try KHR if EXT failed, wasn't present, or eglGetProcAddress failed
-	if (state.egl_display == EGL_NO_DISPLAY && has_khr_platform) {
+	if (state.egl_display == EGL_NO_DISPLAY && has_khr_platform &&
+			!state.use_shm) {
 		eglGetPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)
 				eglGetProcAddress( // Cast to the known EXT type
 						"eglGetPlatformDisplayKHR");
@@ -594,12 +2859,14 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 	EGLConfig *configs = calloc(count, sizeof(EGLConfig));
-	EGLint config_attrib_list[] = {EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
-			EGL_RED_SIZE,
-			8, // Request 8-bit per channel
-			EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_ALPHA_SIZE,
-			8, // Request alpha channel for transparency
-			EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE};
+	/* offscreen rendering needs no particular surface type */
+	EGLint config_attrib_list[] = {EGL_SURFACE_TYPE,
+			state.use_shm ? 0 : EGL_WINDOW_BIT, EGL_RED_SIZE,
+			state.format->red_size, EGL_GREEN_SIZE,
+			state.format->green_size, EGL_BLUE_SIZE,
+			state.format->blue_size, EGL_ALPHA_SIZE,
+			state.format->alpha_size, EGL_RENDERABLE_TYPE,
+			EGL_OPENGL_BIT, EGL_NONE};
 	int nret = 0;
 	if (!eglChooseConfig(state.egl_display, config_attrib_list, configs,
 			    count, &nret) ||
@@ -609,8 +2876,35 @@ int main(int argc, char **argv)
 		free(configs);
 		return EXIT_FAILURE;
 	}
+	/* eglChooseConfig sorts deeper configs first, so look for an exact
+	 * match to actually get the cheaper formats */
 	state.egl_config = configs[0];
+	bool exact_config = false;
+	for (int i = 0; i < nret; i++) {
+		EGLint r = 0, g = 0, b = 0, a = 0;
+		eglGetConfigAttrib(state.egl_display, configs[i], EGL_RED_SIZE,
+				&r);
+		eglGetConfigAttrib(state.egl_display, configs[i],
+				EGL_GREEN_SIZE, &g);
+		eglGetConfigAttrib(state.egl_display, configs[i], EGL_BLUE_SIZE,
+				&b);
+		eglGetConfigAttrib(state.egl_display, configs[i],
+				EGL_ALPHA_SIZE, &a);
+		if (r == state.format->red_size &&
+				g == state.format->green_size &&
+				b == state.format->blue_size &&
+				a == state.format->alpha_size) {
+			state.egl_config = configs[i];
+			exact_config = true;
+			break;
+		}
+	}
 	free(configs);
+	if (!exact_config) {
+		fprintf(stderr, "No exact EGL config for format %s, using a "
+				"deeper one\n",
+				state.format->name);
+	}
 
 	// Request at least OpenGL ES 2.0 or OpenGL 2.0 (desktop)
 	EGLint context_attribs[] = {EGL_CONTEXT_MAJOR_VERSION, 2,
@@ -643,91 +2937,24 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
-	FILE *frag_file = fopen(state.shader_path, "rb");
-	if (!frag_file) {
-		fprintf(stderr, "Failed to read shader file at '%s'\n",
-				state.shader_path);
-		return EXIT_FAILURE;
-	}
-	fseek(frag_file, 0, SEEK_END);
-	GLint frag_len = (GLint)ftell(frag_file);
-	fseek(frag_file, 0, SEEK_SET);
-	char *frag_text = (char *)malloc(
-			(size_t)frag_len + 1); // +1 for null terminator
-	if (!frag_text) {
-		fprintf(stderr, "Failed to allocate space to read shader file\n");
-		fclose(frag_file);
-		return EXIT_FAILURE;
-	}
-	fread(frag_text, (size_t)frag_len, 1, frag_file);
-	frag_text[frag_len] = '\0'; // Null-terminate the string
-	fclose(frag_file);
-
-	GLint glstatus;
-	GLuint frag_shader = glCreateShader(GL_FRAGMENT_SHADER);
-	const char *frag_parts[] = {
-			frag_prologue, // Contains uniforms, no version
-			frag_text,
-			frag_coda,
-	};
-	int frag_lengths[] = {
-			(int)strlen(frag_prologue),
-			frag_len,
-			(int)strlen(frag_coda),
-	};
-	glShaderSource(frag_shader, sizeof(frag_parts) / sizeof(frag_parts[0]),
-			frag_parts, frag_lengths);
-	free(frag_text);
-	glCompileShader(frag_shader);
-	glGetShaderiv(frag_shader, GL_COMPILE_STATUS, &glstatus);
-	if (!glstatus) {
-		char log[1024] = {0};
-		GLsizei len;
-		glGetShaderInfoLog(frag_shader, 1024, &len, log);
-		fprintf(stderr, "Failed to compile fragment shader:\n%.*s\n",
-				len, log);
-		return EXIT_FAILURE;
+	/* the image shader's declarations depend on the state stage */
+	if (state.state_path) {
+		state.state_text = read_file(state.state_path);
+		if (!state.state_text || !setup_state_stage(&state)) {
+			return EXIT_FAILURE;
+		}
 	}
 
-	/* *** FIX: Reverted to the original vertex shader loading *** */
-	GLuint vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-	const char *vtext = vertex_shader_text;
-	glShaderSource(vertex_shader, 1, &vtext, NULL);
-	glCompileShader(vertex_shader);
-	glGetShaderiv(vertex_shader, GL_COMPILE_STATUS, &glstatus);
-	if (!glstatus) {
-		char log[1024] = {0};
-		GLsizei len;
-		glGetShaderInfoLog(vertex_shader, 1024, &len, log);
-		fprintf(stderr, "Failed to compile vertex shader:\n%.*s\n", len,
-				log);
+	/* Compilation continues in the background while the outputs are set
+	 * up; they show a placeholder until it completes */
+	char *frag_text = read_file(state.shader_path);
+	if (!frag_text || !setup_noise_textures(&state, frag_text)) {
 		return EXIT_FAILURE;
 	}
-
-	state.shader_prog = glCreateProgram();
-	glAttachShader(state.shader_prog, frag_shader);
-	glAttachShader(state.shader_prog, vertex_shader);
+	/* the GLSL build for comparison needs the text again */
+	char *bench_text = bench_spirv ? strdup(frag_text) : NULL;
+	start_shader_build(&state, frag_text);
 	state.attr_pos = 0;
-	glBindAttribLocation(state.shader_prog, state.attr_pos, "pos");
-	glLinkProgram(state.shader_prog);
-	glGetProgramiv(state.shader_prog, GL_LINK_STATUS, &glstatus);
-	if (!glstatus) {
-		char log[1024] = {0};
-		GLsizei len;
-		glGetProgramInfoLog(state.shader_prog, 1000, &len, log);
-		fprintf(stderr, "Failed to link shader:\n%.*s\n", len, log);
-		exit(1);
-	}
-	glDeleteShader(frag_shader);
-	glDeleteShader(vertex_shader);
-
-	state.unif_iResolution =
-			glGetUniformLocation(state.shader_prog, "iResolution");
-	state.unif_iTime = glGetUniformLocation(state.shader_prog, "iTime");
-	state.unif_iTimeDelta =
-			glGetUniformLocation(state.shader_prog, "iTimeDelta");
-	state.unif_iFrame = glGetUniformLocation(state.shader_prog, "iFrame");
-	state.unif_iMouse = glGetUniformLocation(state.shader_prog, "iMouse");
 
 	glGenVertexArrays(1, &state.vertex_array);
 	glBindVertexArray(state.vertex_array);
@@ -748,10 +2975,27 @@ int main(int argc, char **argv)
 	glBufferData(GL_ARRAY_BUFFER, sizeof(vertex_data), vertex_data,
 			GL_STATIC_DRAW);
 
+	if (state.vertex_count && !setup_geometry(&state)) {
+		return EXIT_FAILURE;
+	}
+	if (state.render_fps > 0 && !setup_interpolation(&state)) {
+		return EXIT_FAILURE;
+	}
+
 	if (!check_gl_errors("loading shaders")) {
 		return EXIT_FAILURE;
 	}
 
+	if (bench_formats) {
+		wait_for_shader_build(&state);
+		bench_surface_formats(&state);
+		return EXIT_SUCCESS;
+	}
+	if (bench_spirv) {
+		bench_shader_builds(&state, bench_text);
+		return EXIT_SUCCESS;
+	}
+
 	/* bind all globals */
 	wl_display_roundtrip(state.display);
 	/* learn all output names, and create outputs if necessary */
@@ -764,7 +3008,7 @@ int main(int argc, char **argv)
 	struct timespec start_time;
 	struct timespec next_draw_time;
 	struct timespec last_frame_time;
-	int64_t period_ns;
+	struct timespec last_stats_time;
 	struct timespec period;
 	int display_fd;
 	int ret = EXIT_SUCCESS; // Initializing a variable in the declaration is
@@ -776,21 +3020,31 @@ int main(int argc, char **argv)
 	clock_gettime(CLOCK_MONOTONIC, &start_time);
 	next_draw_time = start_time;
 	last_frame_time = start_time;
+	last_stats_time = start_time;
 
-	period_ns = (state.fps == INFINITY) ? 0 : (1e9f / state.fps);
-
-	// Assigning struct members *after* the struct is declared and
-	// 'period_ns' is set.
-	period.tv_sec = period_ns / 1000000000;
-	period.tv_nsec = period_ns % 1000000000;
+	if (state.power.enabled) {
+		power_policy_update(&state.power, start_time);
+	}
+	apply_power_profile(&state);
+	period = fps_period(state.fps);
 
 	display_fd = wl_display_get_fd(state.display);
 
-	while (true) {
+	while (!stop_requested) {
 		// Dispatch pending events first, before attempting to read more
-		while (wl_display_dispatch_pending(state.display) != -1) {
+		TRACE_BEGIN(t_dispatch);
+		/* timestamps for --stats only; cur_time is always needed */
+		struct timespec dispatch_start, poll_start, work_end;
+		if (state.print_stats) {
+			clock_gettime(CLOCK_MONOTONIC, &dispatch_start);
+		}
+		state.loop_stats.iterations++;
+		int dispatched;
+		while ((dispatched = wl_display_dispatch_pending(
+					state.display)) > 0) {
 			// Keep dispatching until there are no more pending
 			// events
+			state.loop_stats.events += dispatched;
 		}
 
 		// After dispatching, flush any outgoing requests
@@ -799,9 +3053,30 @@ int main(int argc, char **argv)
 					strerror(errno));
 			break;
 		}
+		TRACE_END(t_dispatch, "dispatch", TRACE_MAIN_TRACK);
 
 		struct timespec cur_time;
 		clock_gettime(CLOCK_MONOTONIC, &cur_time);
+		if (state.print_stats) {
+			state.loop_stats.dispatch_time +=
+					timespec_diff(cur_time, dispatch_start);
+			/* every iteration, including those that draw nothing */
+			float elapsed = timespec_diff(cur_time, last_stats_time);
+			if (elapsed >= STATS_INTERVAL) {
+				report_stats(&state, elapsed);
+				last_stats_time = cur_time;
+			}
+		}
+
+		if (state.power.enabled &&
+				power_policy_update(&state.power, cur_time)) {
+			apply_power_profile(&state);
+			period = fps_period(state.fps);
+		}
+		bool paused = state.power.enabled &&
+			      state.power.current->paused;
+		/* nothing new to show until the shader is built */
+		bool building = !shader_build_done(&state);
 
 		long long ms_until_next_draw;
 		if (state.fps == INFINITY) {
@@ -815,16 +3090,21 @@ int main(int argc, char **argv)
 							1000000LL;
 		}
 
+		/* Outputs without a surface (not matching output_name) never
+		 * get a frame callback, and outputs waiting for a wl_shm
+		 * buffer release must not keep the loop spinning either */
 		struct output *output, *tmp;
 		bool any_output_ready = false;
-		wl_list_for_each_safe(output, tmp, &state.outputs, link)
+		wl_list_for_each(output, &state.outputs, link)
 		{
-			any_output_ready = any_output_ready ||
-					   (!output->frame_callback);
+			if (output_ready(output)) {
+				any_output_ready = true;
+				break;
+			}
 		}
 
 		int timeout_ms;
-		if (!any_output_ready) {
+		if (!any_output_ready || paused) {
 			timeout_ms = -1; // Wait indefinitely for events
 		} else if (state.fps == INFINITY) {
 			timeout_ms = 0; // Draw as fast as possible
@@ -833,18 +3113,41 @@ int main(int argc, char **argv)
 							? ms_until_next_draw
 							: 1);
 		}
+		if (building && (timeout_ms < 0 ||
+						 timeout_ms > SHADER_POLL_MS)) {
+			timeout_ms = SHADER_POLL_MS;
+		}
+		if (state.power.enabled) {
+			/* wake up in time to recheck battery/thermal state */
+			int check_ms = power_policy_ms_until_check(
+					&state.power, cur_time);
+			if (timeout_ms < 0 || check_ms < timeout_ms) {
+				timeout_ms = check_ms;
+			}
+		}
 
 		struct pollfd pollfd;
 		pollfd.events = POLLIN;
 		pollfd.fd = display_fd;
+		TRACE_BEGIN(t_poll);
+		if (state.print_stats) {
+			clock_gettime(CLOCK_MONOTONIC, &poll_start);
+		}
 		int nr = poll(&pollfd, 1, timeout_ms);
+		TRACE_END(t_poll, "poll", TRACE_MAIN_TRACK);
 		if (nr < 0 && (errno == EAGAIN || errno == EINTR)) {
+			if (state.print_stats) {
+				clock_gettime(CLOCK_MONOTONIC, &cur_time);
+				state.loop_stats.wait_time += timespec_diff(
+						cur_time, poll_start);
+			}
 			continue;
 		} else if (nr < 0) {
 			fprintf(stderr, "poll failure: %s\n", strerror(errno));
 			break;
 		}
 
+		TRACE_BEGIN(t_read);
 		int prepare_status = wl_display_prepare_read(state.display);
 		if (prepare_status == -1) {
 			if (errno == EAGAIN) {
@@ -867,15 +3170,23 @@ int main(int argc, char **argv)
 				wl_display_cancel_read(state.display);
 			}
 		}
+		TRACE_END(t_read, "read events", TRACE_MAIN_TRACK);
+		clock_gettime(CLOCK_MONOTONIC, &cur_time);
+		if (state.print_stats) {
+			state.loop_stats.wait_time +=
+					timespec_diff(cur_time, poll_start);
+		}
 
 		/* Decide if all frames should be redrawn */
 		bool any_resized = false;
-		wl_list_for_each_safe(output, tmp, &state.outputs, link)
+		wl_list_for_each(output, &state.outputs, link)
 		{
-			any_resized = any_resized || output->needs_resize;
+			if (output->needs_resize) {
+				any_resized = true;
+				break;
+			}
 		}
 
-		clock_gettime(CLOCK_MONOTONIC, &cur_time);
 		float time_until_next_draw =
 				timespec_diff(next_draw_time, cur_time);
 
@@ -883,6 +3194,11 @@ int main(int argc, char **argv)
 				state.fps != INFINITY) {
 			continue;
 		}
+		/* while paused, the last frame stays on screen; only respond
+		 * to configure events */
+		if ((paused || building) && !any_resized) {
+			continue;
+		}
 
 		/* update next draw time, skipping frames if we are behind */
 		if (state.fps != INFINITY) {
@@ -905,10 +3221,19 @@ int main(int argc, char **argv)
 		last_frame_time = cur_time;
 		state.frame_no++;
 
+		if (state.state_size && state.shader_ready) {
+			TRACE_BEGIN(t_step);
+			for (int i = state_steps_due(&state); i > 0; i--) {
+				step_state(&state);
+			}
+			TRACE_END(t_step, "state step", TRACE_MAIN_TRACK);
+		}
+
 		/* Submit redraw information */
+		TRACE_BEGIN(t_frame);
 		wl_list_for_each_safe(output, tmp, &state.outputs, link)
 		{
-			if (!output->egl_window || output->frame_callback) {
+			if (!output_ready(output)) {
 				continue;
 			}
 			if (output->needs_ack) {
@@ -917,7 +3242,23 @@ int main(int argc, char **argv)
 						output->layer_surface,
 						output->last_serial);
 			}
-			if (output->needs_resize) {
+			if (output->needs_resize && state.use_shm) {
+				output->needs_resize = false;
+				if (output->shm_pool->width != output->width ||
+						output->shm_pool->height !=
+								output->height) {
+					shm_pool_destroy(output->shm_pool);
+					output->shm_pool = shm_pool_create(
+							state.shm,
+							output->width,
+							output->height,
+							state.format->shm_format,
+							state.format->shm_bytes_per_pixel);
+					if (!output->shm_pool) {
+						exit(EXIT_FAILURE);
+					}
+				}
+			} else if (output->needs_resize) {
 				output->needs_resize = false;
 				wl_egl_window_resize(output->egl_window,
 						output->width, output->height,
@@ -929,26 +3270,21 @@ int main(int argc, char **argv)
 		/* Batch swap buffer calls after all redraw computations */
 		wl_list_for_each_safe(output, tmp, &state.outputs, link)
 		{
-			if (!output->egl_window || output->frame_callback) {
+			if (!output->configured || output->frame_callback) {
 				continue;
 			}
-			if (!eglMakeCurrent(state.egl_display,
-					    output->egl_surface,
-					    output->egl_surface,
-					    state.egl_context)) {
-				fprintf(stderr, "Failed to make current\n");
-				exit(EXIT_FAILURE);
-			}
-			output->frame_callback =
-					wl_surface_frame(output->surface);
-			wl_callback_add_listener(output->frame_callback,
-					&frame_callback_listener, output);
-			if (!eglSwapBuffers(state.egl_display,
-					    output->egl_surface)) {
-				fprintf(stderr, "Failed to swap buffers\n");
-				exit(EXIT_FAILURE);
-			}
+			present(output);
+		}
+		TRACE_END(t_frame, "frame", TRACE_MAIN_TRACK);
+		/* iterations that skip drawing have no work to count */
+		if (state.print_stats) {
+			clock_gettime(CLOCK_MONOTONIC, &work_end);
+			state.loop_stats.work_time +=
+					timespec_diff(work_end, cur_time);
 		}
 	}
+#ifdef SHADERBG_TRACE
+	trace_stop();
+#endif
 	return ret;
 }
\ No newline at end of file
@@ -0,0 +1,360 @@
+#include "noise.h"
+#include "cache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* bump whenever a generator changes, to invalidate old cache files */
+#define NOISE_CACHE_VERSION 1
+
+struct cache_header {
+	char magic[4]; // "SBGN"
+	uint32_t version;
+	uint32_t width, height, depth, channels;
+};
+
+/* The generators work on four lanes at a time, using the GCC/Clang vector
+ * extensions so the same code maps to SSE2 or NEON */
+typedef uint32_t u32x4 __attribute__((vector_size(16)));
+typedef float f32x4 __attribute__((vector_size(16)));
+
+static const u32x4 lane_index = {0, 1, 2, 3};
+
+/* "lowbias32" integer hash by Chris Wellons */
+static inline uint32_t hash(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+static inline u32x4 hash4(u32x4 x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+/* out[i] = hash of (key, i) for 0 <= i < count, a multiple of 4 */
+static void hash_row(uint32_t *out, int count, uint32_t key)
+{
+	u32x4 base = (u32x4){0} + hash(key);
+	for (int i = 0; i < count; i += 4) {
+		u32x4 h = hash4(base + lane_index + (uint32_t)i);
+		memcpy(out + i, &h, sizeof(h));
+	}
+}
+
+static uint32_t row_key(int channel, int y, int z)
+{
+	return hash((uint32_t)channel * 0x9e3779b9u ^ hash((uint32_t)y) ^
+		    hash((uint32_t)z + 0x632be5abu));
+}
+
+/* Independent uniform bytes per channel; with depth > 1, sampled with
+ * linear filtering and smoothed coordinates it gives 3D value noise */
+static void generate_white(uint8_t *texels, int width, int height, int depth)
+{
+	uint32_t row[width];
+	for (int z = 0; z < depth; z++) {
+		for (int y = 0; y < height; y++) {
+			uint8_t *out = texels + 4 * width * (y + height * z);
+			for (int c = 0; c < 4; c++) {
+				hash_row(row, width, row_key(c, y, z));
+				for (int x = 0; x < width; x++) {
+					out[4 * x + c] = row[x] >> 24;
+				}
+			}
+		}
+	}
+}
+
+/* Smooth, tileable value noise: four octaves, with lattices of 4 to 32
+ * cells across, and a different pattern in each channel. 2D only. */
+static void generate_value(uint8_t *texels, int width, int height, int depth)
+{
+	(void)depth;
+	enum { OCTAVES = 4, MAX_CELLS = 32 };
+	f32x4 acc[width / 4];
+	for (int c = 0; c < 4; c++) {
+		for (int y = 0; y < height; y++) {
+			memset(acc, 0, sizeof(acc));
+			for (int o = 0; o < OCTAVES; o++) {
+				int cells = 4 << o, size = width / cells;
+				float amp = (8 >> o) / 15.f;
+				/* interpolate the two lattice rows around y
+				 * first, then along x; the texels of a chunk
+				 * share their lattice neighbours */
+				uint32_t r0[MAX_CELLS], r1[MAX_CELLS];
+				int cy = y / size;
+				float ty = (float)(y % size) / size;
+				ty = ty * ty * (3.f - 2.f * ty);
+				hash_row(r0, MAX_CELLS, row_key(c, cy, o));
+				int cy1 = (cy + 1) % cells;
+				hash_row(r1, MAX_CELLS, row_key(c, cy1, o));
+				float col[MAX_CELLS];
+				for (int i = 0; i < cells; i++) {
+					float a = (r0[i] >> 8) * 0x1p-24f;
+					float b = (r1[i] >> 8) * 0x1p-24f;
+					col[i] = a + (b - a) * ty;
+				}
+				for (int x = 0; x < width; x += 4) {
+					int cx = x / size;
+					f32x4 tx = ((f32x4){0, 1, 2, 3} +
+							   (float)(x % size)) /
+						   (float)size;
+					tx = tx * tx * (3.f - 2.f * tx);
+					float a = col[cx];
+					float b = col[(cx + 1) % cells];
+					acc[x / 4] += amp * (a + (b - a) * tx);
+				}
+			}
+			uint8_t *out = texels + 4 * width * y;
+			for (int x = 0; x < width; x++) {
+				float v = acc[x / 4][x % 4];
+				out[4 * x + c] = (uint8_t)(v * 255.99f);
+			}
+		}
+	}
+}
+
+#define BLUE_SIZE 64
+#define BLUE_SIGMA 1.5f
+
+/* Add (sign = 1) or remove (sign = -1) a point's share of the energy;
+ * kernel rows are stored twice over, so each update is contiguous */
+static void update_energy(float *energy, const float *kernel, int index,
+		float sign)
+{
+	int px = index % BLUE_SIZE, py = index / BLUE_SIZE;
+	for (int y = 0; y < BLUE_SIZE; y++) {
+		const float *k = kernel +
+				 2 * BLUE_SIZE * ((y - py) & (BLUE_SIZE - 1)) +
+				 BLUE_SIZE - px;
+		float *e = energy + BLUE_SIZE * y;
+		for (int x = 0; x < BLUE_SIZE; x += 4) {
+			f32x4 ev, kv;
+			memcpy(&ev, e + x, sizeof(ev));
+			memcpy(&kv, k + x, sizeof(kv));
+			ev += sign * kv;
+			memcpy(e + x, &ev, sizeof(ev));
+		}
+	}
+}
+
+/* The point (set == true) in the densest spot, or the empty spot
+ * (set == false) in the sparsest one */
+static int find_extreme(const float *energy, const bool *pattern, bool set)
+{
+	int best = -1;
+	for (int i = 0; i < BLUE_SIZE * BLUE_SIZE; i++) {
+		if (pattern[i] != set) {
+			continue;
+		}
+		if (best < 0 || (set ? energy[i] > energy[best]
+				     : energy[i] < energy[best])) {
+			best = i;
+		}
+	}
+	return best;
+}
+
+/* Blue noise by Ulichney's void-and-cluster method: every threshold of the
+ * texture gives evenly spread points, without low frequencies. The size is
+ * fixed at BLUE_SIZE x BLUE_SIZE. */
+static void generate_blue(uint8_t *texels, int width, int height, int depth)
+{
+	(void)width;
+	(void)height;
+	(void)depth;
+	enum { N = BLUE_SIZE * BLUE_SIZE };
+	static float kernel[BLUE_SIZE * 2 * BLUE_SIZE];
+	static float energy[N], start_energy[N];
+	static bool pattern[N], start_pattern[N];
+	static int rank[N];
+	for (int dy = 0; dy < BLUE_SIZE; dy++) {
+		for (int dx = 0; dx < 2 * BLUE_SIZE; dx++) {
+			int ax = dx % BLUE_SIZE, ay = dy;
+			ax = ax < BLUE_SIZE - ax ? ax : BLUE_SIZE - ax;
+			ay = ay < BLUE_SIZE - ay ? ay : BLUE_SIZE - ay;
+			float r2 = (float)(ax * ax + ay * ay);
+			kernel[2 * BLUE_SIZE * dy + dx] = expf(
+					-r2 / (2.f * BLUE_SIGMA * BLUE_SIGMA));
+		}
+	}
+
+	/* a tenth of the pixels at random, then spread out evenly */
+	memset(energy, 0, sizeof(energy));
+	int ones = 0;
+	for (int i = 0; i < N; i++) {
+		pattern[i] = hash((uint32_t)i ^ 0xb1e5eedu) < 0x1999999au;
+		if (pattern[i]) {
+			update_energy(energy, kernel, i, 1.f);
+			ones++;
+		}
+	}
+	for (int iter = 0; iter < N; iter++) {
+		int cluster = find_extreme(energy, pattern, true);
+		pattern[cluster] = false;
+		update_energy(energy, kernel, cluster, -1.f);
+		int gap = find_extreme(energy, pattern, false);
+		pattern[gap] = true;
+		update_energy(energy, kernel, gap, 1.f);
+		if (gap == cluster) {
+			break;
+		}
+	}
+	memcpy(start_energy, energy, sizeof(energy));
+	memcpy(start_pattern, pattern, sizeof(pattern));
+
+	/* rank the initial points by removing the tightest clusters... */
+	for (int count = ones; count > 0; count--) {
+		int cluster = find_extreme(energy, pattern, true);
+		pattern[cluster] = false;
+		update_energy(energy, kernel, cluster, -1.f);
+		rank[cluster] = count - 1;
+	}
+	/* ...and the rest by filling the largest voids. (Past half full,
+	 * this is the same as picking the tightest cluster of empty spots,
+	 * as the energies of both add up to a constant.) */
+	memcpy(energy, start_energy, sizeof(energy));
+	memcpy(pattern, start_pattern, sizeof(pattern));
+	for (int count = ones; count < N; count++) {
+		int gap = find_extreme(energy, pattern, false);
+		pattern[gap] = true;
+		update_energy(energy, kernel, gap, 1.f);
+		rank[gap] = count;
+	}
+	for (int i = 0; i < N; i++) {
+		texels[i] = (uint8_t)(rank[i] * 256 / N);
+	}
+}
+
+const struct noise_texture noise_textures[NUM_NOISE_TEXTURES] = {
+		{"iNoiseWhite", 256, 256, 1, 4, generate_white},
+		{"iNoiseValue", 256, 256, 1, 4, generate_value},
+		{"iNoiseBlue", BLUE_SIZE, BLUE_SIZE, 1, 1, generate_blue},
+		{"iNoise3D", 32, 32, 32, 4, generate_white},
+};
+
+static bool map_cached(const struct noise_texture *tex, const char *path,
+		size_t size, struct noise_data *data)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return false;
+	}
+	struct stat st;
+	size_t map_size = sizeof(struct cache_header) + size;
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size != map_size) {
+		close(fd);
+		return false;
+	}
+	void *map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return false;
+	}
+	const struct cache_header *header = map;
+	if (memcmp(header->magic, "SBGN", 4) ||
+			header->version != NOISE_CACHE_VERSION ||
+			header->width != (uint32_t)tex->width ||
+			header->height != (uint32_t)tex->height ||
+			header->depth != (uint32_t)tex->depth ||
+			header->channels != (uint32_t)tex->channels) {
+		munmap(map, map_size);
+		return false;
+	}
+	data->map = map;
+	data->map_size = map_size;
+	data->texels = (const uint8_t *)map + sizeof(struct cache_header);
+	data->size = size;
+	return true;
+}
+
+/* Write to a temporary file first, so concurrent instances never map a
+ * partial file */
+static void save_cached(const struct noise_texture *tex, const char *path,
+		const uint8_t *texels, size_t size)
+{
+	char tmp[PATH_MAX];
+	int n = snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	if (n < 0 || (size_t)n >= sizeof(tmp) ||
+			!cache_make_parent_dirs(path)) {
+		return;
+	}
+	int fd = mkstemp(tmp);
+	if (fd == -1) {
+		fprintf(stderr, "Failed to write cache file '%s': %s\n", path,
+				strerror(errno));
+		return;
+	}
+	struct cache_header header = {{'S', 'B', 'G', 'N'},
+			NOISE_CACHE_VERSION, (uint32_t)tex->width,
+			(uint32_t)tex->height, (uint32_t)tex->depth,
+			(uint32_t)tex->channels};
+	bool ok = write(fd, &header, sizeof(header)) == sizeof(header) &&
+		  write(fd, texels, size) == (ssize_t)size;
+	close(fd);
+	if (!ok || rename(tmp, path) == -1) {
+		fprintf(stderr, "Failed to write cache file '%s'\n", path);
+		unlink(tmp);
+	}
+}
+
+bool noise_load(const struct noise_texture *tex, struct noise_data *data)
+{
+	size_t size = (size_t)tex->width * tex->height * tex->depth *
+		      tex->channels;
+	char name[64], path[PATH_MAX];
+	snprintf(name, sizeof(name), "%s.raw", tex->name);
+	bool cacheable = cache_path(name, path, sizeof(path));
+	if (cacheable && map_cached(tex, path, size, data)) {
+		return true;
+	}
+
+	uint8_t *texels = malloc(size);
+	if (!texels) {
+		fprintf(stderr, "Failed to allocate noise texture\n");
+		return false;
+	}
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	tex->generate(texels, tex->width, tex->height, tex->depth);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	fprintf(stderr, "Generated noise texture %s in %.1f ms\n", tex->name,
+			1e3 * (t1.tv_sec - t0.tv_sec) +
+					1e-6 * (t1.tv_nsec - t0.tv_nsec));
+	if (cacheable) {
+		save_cached(tex, path, texels, size);
+	}
+	data->texels = texels;
+	data->size = size;
+	data->map = NULL;
+	data->map_size = 0;
+	return true;
+}
+
+void noise_release(struct noise_data *data)
+{
+	if (data->map) {
+		munmap(data->map, data->map_size);
+	} else {
+		free((void *)data->texels);
+	}
+	*data = (struct noise_data){0};
+}
@@ -0,0 +1,38 @@
+#ifndef SHADERBG_NOISE_H
+#define SHADERBG_NOISE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Precomputed noise textures for shaders, in place of per-pixel hashing.
+ * Each is generated once, then cached in $XDG_CACHE_HOME/shaderbg as a
+ * small header followed by the raw texels, which later runs map directly. */
+
+struct noise_texture {
+	const char *name; // sampler name in shaders
+	int width, height, depth; // depth is 1 for 2D textures
+	int channels;             // 1 (luminance) or 4 (RGBA), 8 bits each
+	void (*generate)(uint8_t *texels, int width, int height, int depth);
+};
+
+#define NUM_NOISE_TEXTURES 4
+
+extern const struct noise_texture noise_textures[NUM_NOISE_TEXTURES];
+
+/* Texels of a loaded texture, rows tightly packed */
+struct noise_data {
+	const uint8_t *texels;
+	size_t size;
+	void *map; // mapping of the cache file, or NULL if texels is malloc'd
+	size_t map_size;
+};
+
+/* Map the cached texels, or generate (and try to cache) them. Returns
+ * false only if memory runs out; a missing or unwritable cache just costs
+ * the generation time. */
+bool noise_load(const struct noise_texture *tex, struct noise_data *data);
+
+void noise_release(struct noise_data *data);
+
+#endif
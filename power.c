@@ -0,0 +1,176 @@
+#include "power.h"
+#include <dirent.h>
+#include <math.h> // For INFINITY
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* How far the temperature must drop below a threshold before the less
+ * restrictive profile is restored; avoids flapping around the threshold */
+#define THERMAL_HYSTERESIS 5.f
+
+void power_policy_init(struct power_policy *policy)
+{
+	policy->enabled = true;
+	policy->power_supply_dir = "/sys/class/power_supply";
+	policy->thermal_dir = "/sys/class/thermal";
+	policy->throttle_temp = 85.f;
+	policy->pause_temp = 95.f;
+	policy->interval = 2.f;
+	policy->ac = (struct power_profile){"ac", INFINITY, 1.f, false};
+	policy->battery = (struct power_profile){"battery", 30.f, 1.f, false};
+	policy->hot = (struct power_profile){"hot", 10.f, .5f, false};
+	policy->critical = (struct power_profile){"critical", 1.f, .5f, true};
+	policy->current = NULL;
+	policy->next_check = (struct timespec){0, 0};
+}
+
+/* Read the first line of dir/entry/name into buf, without the newline */
+static bool read_sysfs(const char *dir, const char *entry, const char *name,
+		char *buf, size_t len)
+{
+	char path[512];
+	snprintf(path, sizeof(path), "%s/%s/%s", dir, entry, name);
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		return false;
+	}
+	bool ok = fgets(buf, (int)len, f) != NULL;
+	fclose(f);
+	if (ok) {
+		buf[strcspn(buf, "\n")] = '\0';
+	}
+	return ok;
+}
+
+static bool on_battery(const char *power_supply_dir)
+{
+	DIR *dir = opendir(power_supply_dir);
+	if (!dir) {
+		return false;
+	}
+	bool has_battery = false, mains_online = false, discharging = false;
+	struct dirent *ent;
+	char buf[64];
+	while ((ent = readdir(dir))) {
+		if (ent->d_name[0] == '.') {
+			continue;
+		}
+		if (!read_sysfs(power_supply_dir, ent->d_name, "type", buf,
+				    sizeof(buf))) {
+			continue;
+		}
+		if (!strcmp(buf, "Mains") || !strncmp(buf, "USB", 3)) {
+			if (read_sysfs(power_supply_dir, ent->d_name, "online",
+					    buf, sizeof(buf)) &&
+					!strcmp(buf, "1")) {
+				mains_online = true;
+			}
+		} else if (!strcmp(buf, "Battery")) {
+			/* batteries in mice, keyboards, etc. are not relevant
+			 */
+			if (read_sysfs(power_supply_dir, ent->d_name, "scope",
+					    buf, sizeof(buf)) &&
+					!strcmp(buf, "Device")) {
+				continue;
+			}
+			has_battery = true;
+			if (read_sysfs(power_supply_dir, ent->d_name, "status",
+					    buf, sizeof(buf)) &&
+					!strcmp(buf, "Discharging")) {
+				discharging = true;
+			}
+		}
+	}
+	closedir(dir);
+	/* desktops may still list offline USB-C or UCSI supplies */
+	return has_battery && (discharging || !mains_online);
+}
+
+/* Returns the hottest thermal zone temperature, in degrees C, or -INFINITY if
+ * none could be read */
+static float max_temperature(const char *thermal_dir)
+{
+	DIR *dir = opendir(thermal_dir);
+	if (!dir) {
+		return -INFINITY;
+	}
+	float max_temp = -INFINITY;
+	struct dirent *ent;
+	char buf[64];
+	while ((ent = readdir(dir))) {
+		if (strncmp(ent->d_name, "thermal_zone", 12)) {
+			continue;
+		}
+		if (!read_sysfs(thermal_dir, ent->d_name, "temp", buf,
+				    sizeof(buf))) {
+			continue;
+		}
+		/* values are in millidegrees */
+		float temp = 1e-3f * strtof(buf, NULL);
+		if (temp > max_temp) {
+			max_temp = temp;
+		}
+	}
+	closedir(dir);
+	return max_temp;
+}
+
+static bool timespec_before(struct timespec a, struct timespec b)
+{
+	return a.tv_sec < b.tv_sec ||
+	       (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+bool power_policy_update(struct power_policy *policy, struct timespec now)
+{
+	if (policy->current && timespec_before(now, policy->next_check)) {
+		return false;
+	}
+	long long interval_ns = (long long)(policy->interval * 1e9f);
+	policy->next_check.tv_sec = now.tv_sec + interval_ns / 1000000000;
+	policy->next_check.tv_nsec = now.tv_nsec + interval_ns % 1000000000;
+	if (policy->next_check.tv_nsec >= 1000000000) {
+		policy->next_check.tv_sec++;
+		policy->next_check.tv_nsec -= 1000000000;
+	}
+
+	const struct power_profile *prev = policy->current;
+	float temp = max_temperature(policy->thermal_dir);
+	float pause_temp = policy->pause_temp;
+	float throttle_temp = policy->throttle_temp;
+	if (prev == &policy->critical) {
+		pause_temp -= THERMAL_HYSTERESIS;
+	}
+	if (prev == &policy->critical || prev == &policy->hot) {
+		throttle_temp -= THERMAL_HYSTERESIS;
+	}
+
+	if (temp >= pause_temp) {
+		policy->current = &policy->critical;
+	} else if (temp >= throttle_temp) {
+		policy->current = &policy->hot;
+	} else if (on_battery(policy->power_supply_dir)) {
+		policy->current = &policy->battery;
+	} else {
+		policy->current = &policy->ac;
+	}
+	if (policy->current == prev) {
+		return false;
+	}
+	fprintf(stderr,
+			"Power policy: using '%s' profile (fps = %f, scale = "
+			"%f%s), temperature %.1f C\n",
+			policy->current->name, policy->current->fps,
+			policy->current->render_scale,
+			policy->current->paused ? ", paused" : "", temp);
+	return true;
+}
+
+int power_policy_ms_until_check(
+		const struct power_policy *policy, struct timespec now)
+{
+	long long ms = 1000LL * (policy->next_check.tv_sec - now.tv_sec) +
+		       (policy->next_check.tv_nsec - now.tv_nsec) / 1000000LL;
+	return ms > 0 ? (int)ms : 0;
+}
@@ -0,0 +1,41 @@
+#ifndef SHADERBG_POWER_H
+#define SHADERBG_POWER_H
+
+#include <stdbool.h>
+#include <time.h>
+
+/* A set of rendering limits that is applied while a given power/thermal
+ * condition holds. */
+struct power_profile {
+	const char *name;
+	float fps;          // upper bound on the frame rate; INFINITY if none
+	float render_scale; // fraction of the output size to render at
+	bool paused;        // if set, stop drawing new frames entirely
+};
+
+struct power_policy {
+	bool enabled;
+	const char *power_supply_dir; // normally /sys/class/power_supply
+	const char *thermal_dir;      // normally /sys/class/thermal
+	float throttle_temp; // degrees C above which the hot profile is used
+	float pause_temp;    // degrees C above which rendering is paused
+	float interval;      // seconds between rereading sysfs
+	struct power_profile ac;
+	struct power_profile battery;
+	struct power_profile hot;
+	struct power_profile critical;
+	const struct power_profile *current;
+	struct timespec next_check;
+};
+
+void power_policy_init(struct power_policy *policy);
+
+/* Rereads the power supply and thermal state if the check interval has
+ * elapsed. Returns true if the active profile changed. */
+bool power_policy_update(struct power_policy *policy, struct timespec now);
+
+/* Milliseconds until power_policy_update next needs to be called */
+int power_policy_ms_until_check(
+		const struct power_policy *policy, struct timespec now);
+
+#endif
@@ -0,0 +1,148 @@
+#define _GNU_SOURCE // For memfd_create
+#include "shm.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static void free_pool_if_unused(struct shm_pool *pool)
+{
+	for (int i = 0; i < SHM_POOL_BUFFERS; i++) {
+		if (pool->buffers[i].busy) {
+			return;
+		}
+	}
+	for (int i = 0; i < SHM_POOL_BUFFERS; i++) {
+		if (pool->buffers[i].buffer) {
+			wl_buffer_destroy(pool->buffers[i].buffer);
+		}
+	}
+	munmap(pool->data, pool->size);
+	free(pool);
+}
+
+static void buffer_release(void *data, struct wl_buffer *wl_buffer)
+{
+	struct shm_buffer *buffer = data;
+	buffer->busy = false;
+	if (buffer->pool->retired) {
+		free_pool_if_unused(buffer->pool);
+	}
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+		.release = buffer_release,
+};
+
+struct shm_pool *shm_pool_create(struct wl_shm *shm, int width, int height,
+		uint32_t format, int bytes_per_pixel)
+{
+	struct shm_pool *pool = calloc(1, sizeof(struct shm_pool));
+	if (!pool) {
+		fprintf(stderr, "Failed to allocate shm pool\n");
+		return NULL;
+	}
+	pool->width = width;
+	pool->height = height;
+	pool->bytes_per_pixel = bytes_per_pixel;
+	pool->stride = bytes_per_pixel * width;
+	pool->format = format;
+	size_t buffer_size = (size_t)pool->stride * (size_t)height;
+	pool->size = buffer_size * SHM_POOL_BUFFERS;
+
+	int fd = memfd_create("shaderbg-shm", MFD_CLOEXEC);
+	if (fd == -1) {
+		fprintf(stderr, "Failed to create memfd: %s\n",
+				strerror(errno));
+		free(pool);
+		return NULL;
+	}
+	if (ftruncate(fd, (off_t)pool->size) == -1) {
+		fprintf(stderr, "Failed to resize memfd: %s\n",
+				strerror(errno));
+		close(fd);
+		free(pool);
+		return NULL;
+	}
+	pool->data = mmap(NULL, pool->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fd, 0);
+	if (pool->data == MAP_FAILED) {
+		fprintf(stderr, "Failed to map memfd: %s\n", strerror(errno));
+		close(fd);
+		free(pool);
+		return NULL;
+	}
+
+	/* The buffers keep the underlying wl_shm_pool alive, and libwayland
+	 * duplicates the fd when sending it, so neither is needed later */
+	struct wl_shm_pool *wl_pool =
+			wl_shm_create_pool(shm, fd, (int32_t)pool->size);
+	for (int i = 0; i < SHM_POOL_BUFFERS; i++) {
+		struct shm_buffer *buffer = &pool->buffers[i];
+		buffer->pool = pool;
+		buffer->data = pool->data + i * buffer_size;
+		buffer->buffer = wl_shm_pool_create_buffer(wl_pool,
+				(int32_t)(i * buffer_size), width, height,
+				pool->stride, format);
+		wl_buffer_add_listener(buffer->buffer, &buffer_listener, buffer);
+	}
+	wl_shm_pool_destroy(wl_pool);
+	close(fd);
+
+	shm_pool_damage(pool, 0, 0, width, height);
+	return pool;
+}
+
+void shm_pool_destroy(struct shm_pool *pool)
+{
+	if (!pool) {
+		return;
+	}
+	pool->retired = true;
+	free_pool_if_unused(pool);
+}
+
+struct shm_buffer *shm_pool_acquire(struct shm_pool *pool)
+{
+	for (int i = 0; i < SHM_POOL_BUFFERS; i++) {
+		if (!pool->buffers[i].busy) {
+			return &pool->buffers[i];
+		}
+	}
+	return NULL;
+}
+
+void shm_pool_damage(struct shm_pool *pool, int x, int y, int width,
+		int height)
+{
+	for (int i = 0; i < SHM_POOL_BUFFERS; i++) {
+		struct shm_buffer *b = &pool->buffers[i];
+		if (b->damage_x0 >= b->damage_x1) {
+			b->damage_x0 = x;
+			b->damage_y0 = y;
+			b->damage_x1 = x + width;
+			b->damage_y1 = y + height;
+			continue;
+		}
+		if (x < b->damage_x0) {
+			b->damage_x0 = x;
+		}
+		if (y < b->damage_y0) {
+			b->damage_y0 = y;
+		}
+		if (x + width > b->damage_x1) {
+			b->damage_x1 = x + width;
+		}
+		if (y + height > b->damage_y1) {
+			b->damage_y1 = y + height;
+		}
+	}
+}
+
+void shm_buffer_clear_damage(struct shm_buffer *buffer)
+{
+	buffer->damage_x0 = buffer->damage_y0 = 0;
+	buffer->damage_x1 = buffer->damage_y1 = 0;
+}
@@ -0,0 +1,61 @@
+#ifndef SHADERBG_SHM_H
+#define SHADERBG_SHM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <wayland-client.h>
+
+/* Number of buffers per output; three allow one to be held by the
+ * compositor, one to be queued, and one to be drawn into */
+#define SHM_POOL_BUFFERS 3
+
+struct shm_pool;
+
+struct shm_buffer {
+	struct shm_pool *pool;
+	struct wl_buffer *buffer;
+	uint8_t *data;
+	/* set from attach until the compositor sends wl_buffer.release */
+	bool busy;
+	/* region that changed since the buffer contents were last written;
+	 * empty if x0 >= x1 */
+	int damage_x0, damage_y0, damage_x1, damage_y1;
+};
+
+/* A single memfd-backed allocation holding all buffers for one output size */
+struct shm_pool {
+	uint8_t *data;
+	size_t size;
+	int width, height, stride;
+	int bytes_per_pixel;
+	uint32_t format;
+	/* set once the output has switched to a new pool; the pool is freed
+	 * when the compositor releases the last busy buffer */
+	bool retired;
+	struct shm_buffer buffers[SHM_POOL_BUFFERS];
+};
+
+struct shm_stats {
+	uint64_t frames;
+	uint64_t bytes_copied;
+	double copy_time; // seconds spent reading back pixels
+};
+
+struct shm_pool *shm_pool_create(struct wl_shm *shm, int width, int height,
+		uint32_t format, int bytes_per_pixel);
+
+/* Retire the pool; its memory is released once no buffer is busy */
+void shm_pool_destroy(struct shm_pool *pool);
+
+/* Returns a buffer not held by the compositor, or NULL if all are busy */
+struct shm_buffer *shm_pool_acquire(struct shm_pool *pool);
+
+/* Mark a rectangle (in top-down buffer coordinates) as changed in every
+ * buffer of the pool */
+void shm_pool_damage(struct shm_pool *pool, int x, int y, int width,
+		int height);
+
+/* Forget the damage of a buffer, after its contents have been updated */
+void shm_buffer_clear_damage(struct shm_buffer *buffer);
+
+#endif
@@ -0,0 +1,171 @@
+#include "spirv.h"
+#include "cache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+/* bump whenever the tool options change, to invalidate old binaries */
+#define SPIRV_CACHE_VERSION 2
+
+#define SPIRV_MAGIC 0x07230203u
+
+/* 64-bit FNV-1a over everything that determines the binary */
+static uint64_t hash_source(
+		const char *stage, const char *const *parts, int count)
+{
+	uint64_t h = 0xcbf29ce484222325u;
+	char version[16];
+	snprintf(version, sizeof(version), "%d", SPIRV_CACHE_VERSION);
+	const char *prefix[] = {version, stage};
+	for (int i = 0; i < 2 + count; i++) {
+		const char *c = i < 2 ? prefix[i] : parts[i - 2];
+		for (; *c; c++) {
+			h = (h ^ (unsigned char)*c) * 0x100000001b3u;
+		}
+		/* separate the parts, so moving text across them matters */
+		h = (h ^ 0xffu) * 0x100000001b3u;
+	}
+	return h;
+}
+
+static bool read_binary(const char *path, struct spirv_binary *binary)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size < 20 || st.st_size % 4) {
+		close(fd);
+		return false;
+	}
+	size_t size = (size_t)st.st_size;
+	uint32_t *words = malloc(size);
+	if (!words || read(fd, words, size) != (ssize_t)size ||
+			words[0] != SPIRV_MAGIC) {
+		free(words);
+		close(fd);
+		return false;
+	}
+	close(fd);
+	binary->words = words;
+	binary->size = size;
+	return true;
+}
+
+static bool write_source(
+		const char *path, const char *const *parts, int count)
+{
+	FILE *file = fopen(path, "w");
+	if (!file) {
+		fprintf(stderr, "Failed to write '%s'\n", path);
+		return false;
+	}
+	for (int i = 0; i < count; i++) {
+		fputs(parts[i], file);
+	}
+	return fclose(file) == 0;
+}
+
+/* Run a tool from PATH, with its output going to stderr; true if it
+ * succeeds */
+static bool run_tool(char *const argv[])
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(
+			&actions, STDERR_FILENO, STDOUT_FILENO);
+	pid_t pid;
+	int err = posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	if (err) {
+		fprintf(stderr, "Failed to run %s: %s\n", argv[0],
+				strerror(err));
+		return false;
+	}
+	int status;
+	while (waitpid(pid, &status, 0) == -1) {
+		if (errno != EINTR) {
+			return false;
+		}
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s failed\n", argv[0]);
+		return false;
+	}
+	return true;
+}
+
+bool spirv_compile(const char *stage, const char *const *parts, int count,
+		struct spirv_binary *binary)
+{
+	char name[64], path[PATH_MAX];
+	snprintf(name, sizeof(name), "spirv/%016llx.%s.spv",
+			(unsigned long long)hash_source(stage, parts, count),
+			stage);
+	if (!cache_path(name, path, sizeof(path))) {
+		fprintf(stderr, "No cache directory for SPIR-V binaries\n");
+		return false;
+	}
+	if (read_binary(path, binary)) {
+		return true;
+	}
+
+	/* Build in a private directory next to the cache file, and move
+	 * the result into place, so concurrent instances never read a
+	 * partial binary */
+	char dir[PATH_MAX];
+	char src[PATH_MAX + 16], raw[PATH_MAX + 16], opt[PATH_MAX + 16];
+	int n = snprintf(dir, sizeof(dir), "%s.XXXXXX", path);
+	if (n < 0 || (size_t)n >= sizeof(dir) ||
+			!cache_make_parent_dirs(path)) {
+		return false;
+	}
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "Failed to create '%s': %s\n", dir,
+				strerror(errno));
+		return false;
+	}
+	snprintf(src, sizeof(src), "%s/src.glsl", dir);
+	snprintf(raw, sizeof(raw), "%s/raw.spv", dir);
+	snprintf(opt, sizeof(opt), "%s/opt.spv", dir);
+	char *compile[] = {"glslangValidator", "-G", "-S", (char *)stage,
+			"-o", raw, src, NULL};
+	/* loops are only unrolled once -O has put them in SSA form, and the
+	 * unrolled bodies need another -O to fold their constants */
+	char *optimize[] = {"spirv-opt", "-O", "--loop-unroll", "-O", raw,
+			"-o", opt, NULL};
+
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	bool ok = write_source(src, parts, count) && run_tool(compile) &&
+		  run_tool(optimize) && rename(opt, path) == 0;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	unlink(src);
+	unlink(raw);
+	unlink(opt);
+	rmdir(dir);
+	if (!ok) {
+		return false;
+	}
+	fprintf(stderr, "Compiled %s shader to SPIR-V in %.1f ms\n", stage,
+			1e3 * (t1.tv_sec - t0.tv_sec) +
+					1e-6 * (t1.tv_nsec - t0.tv_nsec));
+	return read_binary(path, binary);
+}
+
+void spirv_release(struct spirv_binary *binary)
+{
+	free(binary->words);
+	*binary = (struct spirv_binary){0};
+}
@@ -0,0 +1,28 @@
+#ifndef SHADERBG_SPIRV_H
+#define SHADERBG_SPIRV_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Offline compilation of GLSL to SPIR-V, for drivers with
+ * GL_ARB_gl_spirv: glslangValidator compiles the source, and spirv-opt
+ * optimizes it (constant folding, inlining, dead code elimination, loop
+ * unrolling, ...).
+ * Binaries are cached in $XDG_CACHE_HOME/shaderbg/spirv under a hash of
+ * their source, so the tools only run when the shader changes. */
+
+struct spirv_binary {
+	uint32_t *words; // NULL if there is no binary
+	size_t size;     // in bytes
+};
+
+/* Compile the concatenation of parts as the given stage ("vert" or
+ * "frag"). Returns false, having printed why, if the tools are missing
+ * or fail. */
+bool spirv_compile(const char *stage, const char *const *parts, int count,
+		struct spirv_binary *binary);
+
+void spirv_release(struct spirv_binary *binary);
+
+#endif
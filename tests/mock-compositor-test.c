@@ -0,0 +1,884 @@
+/* Runs shaderbg against an in-process stand-in compositor. The compositor
+ * adds outputs one by one up to MAX_OUTPUTS, unplugs and replugs them, and
+ * checks that the cost of each Wayland event and main loop iteration stays
+ * flat and that no output, surface or wl_shm pool outlives its monitor.
+ *
+ * The stand-in replaces the core of libwayland-client (wl_display_* and
+ * wl_proxy_*), which the generated protocol stubs call into; shaderbg itself
+ * runs unchanged with --shm, rendering through surfaceless EGL. */
+#define main shaderbg_main
+#include "../main.c"
+#undef main
+
+#include <stdarg.h>
+#include <sys/time.h>
+
+#define MAX_OUTPUTS 32
+#define OUTPUT_WIDTH 64
+#define OUTPUT_HEIGHT 36
+#define HOTPLUGS 4 // replugs timed per output count
+#define BURSTS 8   // bursts of output events timed per output count
+#define LOOP_WINDOWS 3
+#define LOOP_ITERATIONS 32 // per window
+#define STORM_STEPS 64
+#define SETTLE_ITERATIONS 8
+#define HOLD_TIME_US 250000 // holding on to every buffer
+/* While no buffer is free, the loop should block in poll; spinning, it ran
+ * over a million times a second */
+#define MAX_HOLD_ITERATIONS 32
+#define MAX_HELD (MAX_OUTPUTS * SHM_POOL_BUFFERS)
+#define MAX_EVENTS 8192
+#define MAX_GLOBALS 1024
+/* The costs with MAX_OUTPUTS outputs may be this many times those with one,
+ * plus some slack for timer noise */
+#define MAX_GROWTH 4.
+#define LATENCY_SLACK 2e-3
+#define EVENT_SLACK 10e-6
+#define LOOP_SLACK 10e-6
+
+/* The client's proxy and the compositor's side of the object in one */
+struct wl_proxy {
+	struct wl_list link; // mock.proxies
+	const struct wl_interface *interface;
+	uint32_t version;
+	void (**implementation)(void);
+	void *user_data;
+	uint32_t global; // for bound globals
+	/* wl_surface */
+	struct wl_proxy *role, *attached, *shown, *frame;
+	bool configure_sent;
+	/* zwlr_layer_surface_v1 */
+	struct wl_proxy *surface, *output;
+};
+
+enum event_type {
+	EV_GLOBAL,
+	EV_GLOBAL_REMOVE,
+	EV_SHM_FORMAT,
+	EV_OUTPUT_GEOMETRY,
+	EV_OUTPUT_MODE,
+	EV_OUTPUT_SCALE,
+	EV_OUTPUT_NAME,
+	EV_OUTPUT_DESCRIPTION,
+	EV_OUTPUT_DONE,
+	EV_CONFIGURE,
+	EV_CLOSED,
+	EV_FRAME_DONE,
+	EV_RELEASE,
+};
+
+struct event {
+	enum event_type type;
+	struct wl_proxy *target; // NULL once the proxy is destroyed
+	uint32_t arg, width, height;
+	bool timed; // counted in the per-event cost
+};
+
+struct global {
+	const struct wl_interface *interface;
+	uint32_t version;
+	bool removed;
+	bool shown;       // wl_output with a buffer committed on it
+	double added_at;  // seconds
+	double latency;   // from being added to being shown
+};
+
+enum phase {
+	PHASE_START,
+	PHASE_HOTPLUG,
+	PHASE_EVENTS,
+	PHASE_LOOP,
+	PHASE_GROW,
+	PHASE_STORM,
+	PHASE_SETTLE,
+	PHASE_HOLD,
+	PHASE_UNPLUGGED,
+	PHASE_DONE,
+};
+
+/* Best of the timings taken with a given number of outputs, in seconds */
+struct sample {
+	double latency;       // from adding an output to its first frame
+	double event_cost;    // dispatching one output event
+	double loop_overhead; // main loop iteration, besides its known parts
+};
+
+static struct {
+	struct wl_proxy display;
+	struct wl_proxy *registry;
+	struct wl_list proxies;
+	int wake_fds[2];
+	bool woken;
+	struct event events[MAX_EVENTS];
+	int first_event, num_events;
+	struct global globals[MAX_GLOBALS];
+	uint32_t num_globals; // global names are indices, 0 is unused
+	uint32_t serial;
+	uint32_t random;
+	bool holding; // buffers are not released, but kept in held
+	struct wl_proxy *held[MAX_HELD];
+	int num_held;
+	double hold_start;
+	int failures;
+	struct state *state; // shaderbg's, from the registry listener
+	/* scenario */
+	enum phase phase;
+	uint64_t last_iteration;
+	int outputs;
+	int step;
+	uint32_t waiting_for; // global name of an output not yet shown
+	double burst_time;
+	int burst_events;
+	struct loop_stats loop_start;
+	double loop_start_time;
+	struct sample samples[MAX_OUTPUTS + 1];
+} mock;
+
+static double now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + 1e-9 * t.tv_nsec;
+}
+
+static void wake(void)
+{
+	if (!mock.woken) {
+		mock.woken = write(mock.wake_fds[1], "", 1) == 1;
+	}
+}
+
+static void push_event(enum event_type type, struct wl_proxy *target,
+		uint32_t arg, bool timed)
+{
+	if (mock.num_events == MAX_EVENTS) {
+		fprintf(stderr, "FAIL: event queue overflow\n");
+		exit(EXIT_FAILURE);
+	}
+	int i = (mock.first_event + mock.num_events++) % MAX_EVENTS;
+	mock.events[i] = (struct event){type, target, arg, 0, 0, timed};
+	wake();
+}
+
+static void push_configure(struct wl_proxy *layer_surface, bool small)
+{
+	push_event(EV_CONFIGURE, layer_surface, ++mock.serial, false);
+	int last = (mock.first_event + mock.num_events - 1) % MAX_EVENTS;
+	mock.events[last].width = small ? OUTPUT_WIDTH / 2 : OUTPUT_WIDTH;
+	mock.events[last].height = small ? OUTPUT_HEIGHT / 2 : OUTPUT_HEIGHT;
+}
+
+static void push_output_events(struct wl_proxy *output, bool timed)
+{
+	push_event(EV_OUTPUT_GEOMETRY, output, output->global, timed);
+	push_event(EV_OUTPUT_MODE, output, 0, timed);
+	push_event(EV_OUTPUT_SCALE, output, 1, timed);
+	push_event(EV_OUTPUT_NAME, output, output->global, timed);
+	push_event(EV_OUTPUT_DESCRIPTION, output, 0, timed);
+	push_event(EV_OUTPUT_DONE, output, 0, timed);
+}
+
+static uint32_t add_global(const struct wl_interface *interface,
+		uint32_t version)
+{
+	if (mock.num_globals + 1 == MAX_GLOBALS) {
+		fprintf(stderr, "FAIL: too many globals\n");
+		exit(EXIT_FAILURE);
+	}
+	uint32_t name = ++mock.num_globals;
+	mock.globals[name] = (struct global){.interface = interface,
+			.version = version,
+			.added_at = now()};
+	if (mock.registry) {
+		push_event(EV_GLOBAL, mock.registry, name, false);
+	}
+	return name;
+}
+
+static void remove_global(uint32_t name)
+{
+	mock.globals[name].removed = true;
+	push_event(EV_GLOBAL_REMOVE, mock.registry, name, false);
+}
+
+static struct wl_proxy *create_proxy(
+		const struct wl_interface *interface, uint32_t version)
+{
+	struct wl_proxy *proxy = calloc(1, sizeof(struct wl_proxy));
+	if (!proxy) {
+		fprintf(stderr, "FAIL: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	proxy->interface = interface;
+	proxy->version = version;
+	wl_list_insert(&mock.proxies, &proxy->link);
+	return proxy;
+}
+
+/* The compositor is done with a buffer, unless it holds on to all */
+static void release(struct wl_proxy *buffer)
+{
+	if (mock.holding && mock.num_held < MAX_HELD) {
+		mock.held[mock.num_held++] = buffer;
+	} else {
+		push_event(EV_RELEASE, buffer, 0, false);
+	}
+}
+
+static void commit(struct wl_proxy *surface)
+{
+	if (surface->role && !surface->configure_sent) {
+		/* the initial commit of a layer surface */
+		surface->configure_sent = true;
+		push_configure(surface->role, false);
+	}
+	if (surface->attached) {
+		if (surface->shown && surface->shown != surface->attached) {
+			release(surface->shown);
+		}
+		surface->shown = surface->attached;
+		surface->attached = NULL;
+		struct wl_proxy *output =
+				surface->role ? surface->role->output : NULL;
+		struct global *global =
+				output ? &mock.globals[output->global] : NULL;
+		if (global && !global->shown) {
+			global->shown = true;
+			global->latency = now() - global->added_at;
+		}
+	}
+	if (surface->frame) {
+		push_event(EV_FRAME_DONE, surface->frame, 0, false);
+		surface->frame = NULL;
+	}
+}
+
+static void destroy_proxy(struct wl_proxy *proxy)
+{
+	struct wl_proxy *other;
+	if (proxy->interface == &wl_surface_interface) {
+		/* the compositor lets go of the buffer on screen */
+		if (proxy->shown) {
+			push_event(EV_RELEASE, proxy->shown, 0, false);
+		}
+		if (proxy->role) {
+			proxy->role->surface = NULL;
+		}
+	} else if (proxy->interface == &zwlr_layer_surface_v1_interface) {
+		if (proxy->surface) {
+			proxy->surface->role = NULL;
+		}
+	} else if (proxy->interface == &wl_buffer_interface) {
+		wl_list_for_each(other, &mock.proxies, link)
+		{
+			if (other->shown == proxy || other->attached == proxy) {
+				fprintf(stderr, "FAIL: buffer destroyed while "
+						"on a surface\n");
+				mock.failures++;
+				other->shown = other->attached = NULL;
+			}
+		}
+		for (int i = 0; i < mock.num_held; i++) {
+			if (mock.held[i] == proxy) {
+				mock.held[i--] = mock.held[--mock.num_held];
+			}
+		}
+	} else if (proxy->interface == &wl_callback_interface) {
+		wl_list_for_each(other, &mock.proxies, link)
+		{
+			if (other->frame == proxy) {
+				other->frame = NULL;
+			}
+		}
+	}
+	/* events for destroyed proxies are dropped, as by libwayland */
+	for (int i = 0; i < mock.num_events; i++) {
+		int j = (mock.first_event + i) % MAX_EVENTS;
+		if (mock.events[j].target == proxy) {
+			mock.events[j].target = NULL;
+		}
+	}
+	wl_list_remove(&proxy->link);
+	free(proxy);
+}
+
+/* Handle a request that creates no object */
+static void handle_request(struct wl_proxy *proxy, uint32_t opcode,
+		va_list args)
+{
+	if (proxy->interface == &wl_surface_interface &&
+			opcode == WL_SURFACE_ATTACH) {
+		proxy->attached = va_arg(args, struct wl_proxy *);
+	} else if (proxy->interface == &wl_surface_interface &&
+			opcode == WL_SURFACE_COMMIT) {
+		commit(proxy);
+	}
+}
+
+/* Handle a request that creates the object new */
+static void handle_constructor(struct wl_proxy *proxy, uint32_t opcode,
+		struct wl_proxy *new, va_list args)
+{
+	if (proxy == &mock.display) {
+		mock.registry = new;
+		for (uint32_t name = 1; name <= mock.num_globals; name++) {
+			if (!mock.globals[name].removed) {
+				push_event(EV_GLOBAL, new, name, false);
+			}
+		}
+	} else if (proxy->interface == &wl_registry_interface) {
+		new->global = va_arg(args, uint32_t);
+		if (new->interface == &wl_output_interface) {
+			push_output_events(new, false);
+		} else if (new->interface == &wl_shm_interface) {
+			const uint32_t formats[] = {WL_SHM_FORMAT_ARGB8888,
+					WL_SHM_FORMAT_XRGB8888,
+					WL_SHM_FORMAT_RGB565,
+					WL_SHM_FORMAT_XRGB2101010,
+					WL_SHM_FORMAT_ARGB2101010};
+			size_t count = sizeof(formats) / sizeof(formats[0]);
+			for (size_t i = 0; i < count; i++) {
+				push_event(EV_SHM_FORMAT, new, formats[i],
+						false);
+			}
+		}
+	} else if (proxy->interface == &wl_surface_interface &&
+			opcode == WL_SURFACE_FRAME) {
+		proxy->frame = new;
+	} else if (proxy->interface == &zwlr_layer_shell_v1_interface) {
+		(void)va_arg(args, void *); // the new id
+		new->surface = va_arg(args, struct wl_proxy *);
+		new->output = va_arg(args, struct wl_proxy *);
+		new->surface->role = new;
+	}
+}
+
+struct wl_proxy *wl_proxy_marshal_flags(struct wl_proxy *proxy,
+		uint32_t opcode, const struct wl_interface *interface,
+		uint32_t version, uint32_t flags, ...)
+{
+	va_list args;
+	va_start(args, flags);
+	struct wl_proxy *new = NULL;
+	if (interface) {
+		new = create_proxy(interface, version);
+		handle_constructor(proxy, opcode, new, args);
+	} else {
+		handle_request(proxy, opcode, args);
+	}
+	va_end(args);
+	if (flags & WL_MARSHAL_FLAG_DESTROY) {
+		destroy_proxy(proxy);
+	}
+	return new;
+}
+
+int wl_proxy_add_listener(struct wl_proxy *proxy,
+		void (**implementation)(void), void *data)
+{
+	proxy->implementation = implementation;
+	proxy->user_data = data;
+	if (proxy == mock.registry) {
+		mock.state = data;
+	}
+	return 0;
+}
+
+void wl_proxy_destroy(struct wl_proxy *proxy) { destroy_proxy(proxy); }
+
+uint32_t wl_proxy_get_version(struct wl_proxy *proxy)
+{
+	return proxy->version;
+}
+
+static void deliver(struct event *event)
+{
+	struct wl_proxy *p = event->target;
+	void *data = p->user_data;
+	const void *listener = p->implementation;
+	const struct wl_registry_listener *registry = listener;
+	const struct wl_output_listener *output = listener;
+	const struct zwlr_layer_surface_v1_listener *layer_surface = listener;
+	const struct global *global;
+	char name[32];
+	switch (event->type) {
+	case EV_GLOBAL:
+		global = &mock.globals[event->arg];
+		registry->global(data, (struct wl_registry *)p, event->arg,
+				global->interface->name, global->version);
+		break;
+	case EV_GLOBAL_REMOVE:
+		registry->global_remove(
+				data, (struct wl_registry *)p, event->arg);
+		break;
+	case EV_SHM_FORMAT:
+		((const struct wl_shm_listener *)listener)
+				->format(data, (struct wl_shm *)p, event->arg);
+		break;
+	case EV_OUTPUT_GEOMETRY:
+		output->geometry(data, (struct wl_output *)p,
+				event->arg * OUTPUT_WIDTH, 0, 600, 340,
+				WL_OUTPUT_SUBPIXEL_UNKNOWN, "mock", "mock",
+				WL_OUTPUT_TRANSFORM_NORMAL);
+		break;
+	case EV_OUTPUT_MODE:
+		output->mode(data, (struct wl_output *)p,
+				WL_OUTPUT_MODE_CURRENT, OUTPUT_WIDTH,
+				OUTPUT_HEIGHT, 60000);
+		break;
+	case EV_OUTPUT_SCALE:
+		output->scale(data, (struct wl_output *)p, event->arg);
+		break;
+	case EV_OUTPUT_NAME:
+		snprintf(name, sizeof(name), "MOCK-%u", event->arg);
+		output->name(data, (struct wl_output *)p, name);
+		break;
+	case EV_OUTPUT_DESCRIPTION:
+		output->description(data, (struct wl_output *)p, "mock");
+		break;
+	case EV_OUTPUT_DONE:
+		output->done(data, (struct wl_output *)p);
+		break;
+	case EV_CONFIGURE:
+		layer_surface->configure(data,
+				(struct zwlr_layer_surface_v1 *)p, event->arg,
+				event->width, event->height);
+		break;
+	case EV_CLOSED:
+		layer_surface->closed(data, (struct zwlr_layer_surface_v1 *)p);
+		break;
+	case EV_FRAME_DONE:
+		((const struct wl_callback_listener *)listener)
+				->done(data, (struct wl_callback *)p, 0);
+		break;
+	case EV_RELEASE:
+		((const struct wl_buffer_listener *)listener)
+				->release(data, (struct wl_buffer *)p);
+		break;
+	}
+}
+
+/* Deliver the queued events; those caused by the requests sent meanwhile
+ * come with the next call, as from a compositor on the other end of a socket
+ */
+static int dispatch(void)
+{
+	int count = 0;
+	for (int queued = mock.num_events; queued > 0; queued--) {
+		struct event event = mock.events[mock.first_event];
+		mock.first_event = (mock.first_event + 1) % MAX_EVENTS;
+		mock.num_events--;
+		if (!event.target || !event.target->implementation) {
+			continue;
+		}
+		double start = event.timed ? now() : 0.;
+		deliver(&event);
+		if (event.timed) {
+			mock.burst_time += now() - start;
+			mock.burst_events++;
+		}
+		count++;
+	}
+	return count;
+}
+
+static int count_live(const struct wl_interface *interface)
+{
+	int count = 0;
+	struct wl_proxy *proxy;
+	wl_list_for_each(proxy, &mock.proxies, link)
+	{
+		count += proxy->interface == interface;
+	}
+	return count;
+}
+
+/* Output globals still advertised, each of which shaderbg has bound */
+static int count_outputs(uint32_t *names)
+{
+	int count = 0;
+	for (uint32_t name = 1; name <= mock.num_globals; name++) {
+		struct global *global = &mock.globals[name];
+		if (global->interface == &wl_output_interface &&
+				!global->removed) {
+			if (names) {
+				names[count] = name;
+			}
+			count++;
+		}
+	}
+	return count;
+}
+
+static bool all_outputs_shown(void)
+{
+	for (uint32_t name = 1; name <= mock.num_globals; name++) {
+		struct global *global = &mock.globals[name];
+		if (global->interface == &wl_output_interface &&
+				!global->removed && !global->shown) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Check that exactly the objects of the given number of outputs are alive */
+static void check_leaks(const char *when, int outputs)
+{
+	const struct {
+		const struct wl_interface *interface;
+		int expected;
+	} objects[] = {
+			{&wl_output_interface, outputs},
+			{&wl_surface_interface, outputs},
+			{&zwlr_layer_surface_v1_interface, outputs},
+			{&wl_buffer_interface, outputs * SHM_POOL_BUFFERS},
+			{&wl_shm_pool_interface, 0},
+			{&wl_region_interface, 0},
+	};
+	for (size_t i = 0; i < sizeof(objects) / sizeof(objects[0]); i++) {
+		int live = count_live(objects[i].interface);
+		bool ok = live == objects[i].expected;
+		fprintf(stderr, "%s: %s: %d %s objects, expected %d\n",
+				ok ? "PASS" : "FAIL", when, live,
+				objects[i].interface->name,
+				objects[i].expected);
+		mock.failures += !ok;
+	}
+	int callbacks = count_live(&wl_callback_interface);
+	bool ok = callbacks <= outputs;
+	fprintf(stderr, "%s: %s: %d wl_callback objects, expected at most %d\n",
+			ok ? "PASS" : "FAIL", when, callbacks, outputs);
+	mock.failures += !ok;
+	int tracked = wl_list_length(&mock.state->outputs);
+	ok = tracked == outputs;
+	fprintf(stderr, "%s: %s: shaderbg tracks %d outputs, expected %d\n",
+			ok ? "PASS" : "FAIL", when, tracked, outputs);
+	mock.failures += !ok;
+}
+
+static uint32_t pick(uint32_t count)
+{
+	mock.random = mock.random * 1103515245 + 12345;
+	return (mock.random >> 16) % count;
+}
+
+static struct wl_proxy *find_layer_surface(uint32_t global)
+{
+	struct wl_proxy *proxy;
+	wl_list_for_each(proxy, &mock.proxies, link)
+	{
+		if (proxy->interface == &zwlr_layer_surface_v1_interface &&
+				proxy->output &&
+				proxy->output->global == global) {
+			return proxy;
+		}
+	}
+	return NULL;
+}
+
+/* One step of unplugging, replugging, resizing and closing outputs */
+static void storm(void)
+{
+	uint32_t names[MAX_GLOBALS];
+	int count = count_outputs(names);
+	/* unplug a monitor, and plug in another */
+	remove_global(names[pick(count)]);
+	add_global(&wl_output_interface, 4);
+	/* a monitor that goes away before it is set up */
+	remove_global(add_global(&wl_output_interface, 4));
+	/* resize everything, to either of two sizes */
+	struct wl_proxy *proxy;
+	wl_list_for_each(proxy, &mock.proxies, link)
+	{
+		if (proxy->interface == &zwlr_layer_surface_v1_interface) {
+			push_configure(proxy, mock.step % 2);
+		}
+	}
+	/* the compositor closes a layer surface, then loses its output */
+	count = count_outputs(names);
+	uint32_t name = names[pick(count)];
+	struct wl_proxy *layer_surface = find_layer_surface(name);
+	if (layer_surface) {
+		push_event(EV_CLOSED, layer_surface, 0, false);
+		remove_global(name);
+		add_global(&wl_output_interface, 4);
+	}
+}
+
+/* Seconds per main loop iteration since mock.loop_start, not spent waiting,
+ * dispatching or drawing */
+static double loop_overhead(const struct loop_stats *ls)
+{
+	const struct loop_stats *start = &mock.loop_start;
+	double wall = now() - mock.loop_start_time;
+	double waiting = ls->wait_time - start->wait_time;
+	double dispatching = ls->dispatch_time - start->dispatch_time;
+	double working = ls->work_time - start->work_time;
+	return (wall - waiting - dispatching - working) /
+	       (ls->iterations - start->iterations);
+}
+
+static void start_output_count(void)
+{
+	mock.samples[mock.outputs] =
+			(struct sample){INFINITY, INFINITY, INFINITY};
+	mock.phase = PHASE_HOTPLUG;
+	mock.step = 0;
+}
+
+/* Advance the scenario by one main loop iteration */
+static void advance(void)
+{
+	struct state *state = mock.state;
+	const struct loop_stats *ls = &state->loop_stats;
+	const struct loop_stats *start = &mock.loop_start;
+	struct sample *sample = &mock.samples[mock.outputs];
+	uint32_t names[MAX_GLOBALS];
+	switch (mock.phase) {
+	case PHASE_START:
+		if (state->shader_ready && all_outputs_shown()) {
+			start_output_count();
+		}
+		break;
+	case PHASE_HOTPLUG:
+		if (mock.waiting_for) {
+			struct global *global = &mock.globals[mock.waiting_for];
+			if (!global->shown) {
+				break;
+			}
+			sample->latency =
+					fmin(sample->latency, global->latency);
+			mock.waiting_for = 0;
+		}
+		if (mock.step++ == HOTPLUGS) {
+			mock.phase = PHASE_EVENTS;
+			mock.step = 0;
+			break;
+		}
+		int count = count_outputs(names);
+		remove_global(names[count - 1]);
+		mock.waiting_for = add_global(&wl_output_interface, 4);
+		break;
+	case PHASE_EVENTS:
+		if (mock.step > 0) {
+			sample->event_cost = fmin(sample->event_cost,
+					mock.burst_time / mock.burst_events);
+		}
+		if (mock.step++ == BURSTS) {
+			mock.phase = PHASE_LOOP;
+			mock.step = 0;
+			break;
+		}
+		mock.burst_time = 0.;
+		mock.burst_events = 0;
+		struct wl_proxy *proxy;
+		wl_list_for_each(proxy, &mock.proxies, link)
+		{
+			if (proxy->interface == &wl_output_interface) {
+				push_output_events(proxy, true);
+			}
+		}
+		break;
+	case PHASE_LOOP:
+		/* mock.step is the window being timed */
+		if (mock.step > 0 && ls->iterations >= start->iterations) {
+			if (ls->iterations - start->iterations <
+					LOOP_ITERATIONS) {
+				break;
+			}
+			double overhead = loop_overhead(ls);
+			sample->loop_overhead =
+					fmin(sample->loop_overhead, overhead);
+			if (mock.step == LOOP_WINDOWS) {
+				mock.phase = PHASE_GROW;
+				mock.step = 0;
+				break;
+			}
+		}
+		/* the window starts over if --stats has reset the counters */
+		if (mock.step == 0 || ls->iterations >= start->iterations) {
+			mock.step++;
+		}
+		mock.loop_start = *ls;
+		mock.loop_start_time = now();
+		break;
+	case PHASE_GROW:
+		if (mock.outputs == MAX_OUTPUTS) {
+			mock.phase = PHASE_STORM;
+		} else if (!mock.waiting_for) {
+			mock.waiting_for = add_global(&wl_output_interface, 4);
+		} else if (mock.globals[mock.waiting_for].shown) {
+			mock.waiting_for = 0;
+			mock.outputs++;
+			start_output_count();
+		}
+		break;
+	case PHASE_STORM:
+		storm();
+		if (++mock.step == STORM_STEPS) {
+			mock.phase = PHASE_SETTLE;
+			mock.step = 0;
+		}
+		break;
+	case PHASE_SETTLE:
+		/* let the outputs draw until retired pools are released */
+		if (!all_outputs_shown() || mock.step++ < SETTLE_ITERATIONS) {
+			break;
+		}
+		check_leaks("after the storm", count_outputs(NULL));
+		mock.holding = true;
+		mock.hold_start = now();
+		mock.phase = PHASE_HOLD;
+		mock.step = 0;
+		/* wakes the loop from poll once the time is up */
+		struct itimerval timer = {.it_value = {0, HOLD_TIME_US}};
+		setitimer(ITIMER_REAL, &timer, NULL);
+		break;
+	case PHASE_HOLD:
+		if (now() - mock.hold_start < 1e-6 * HOLD_TIME_US) {
+			mock.step++;
+			break;
+		}
+		bool ok = mock.step <= MAX_HOLD_ITERATIONS;
+		fprintf(stderr,
+				"%s: %d main loop iterations while the "
+				"compositor held every buffer, expected at "
+				"most %d\n",
+				ok ? "PASS" : "FAIL", mock.step,
+				MAX_HOLD_ITERATIONS);
+		mock.failures += !ok;
+		mock.holding = false;
+		for (int i = 0; i < mock.num_held; i++) {
+			push_event(EV_RELEASE, mock.held[i], 0, false);
+		}
+		mock.num_held = 0;
+		int remaining = count_outputs(names);
+		for (int i = 0; i < remaining; i++) {
+			remove_global(names[i]);
+		}
+		mock.phase = PHASE_UNPLUGGED;
+		break;
+	case PHASE_UNPLUGGED:
+	case PHASE_DONE:
+		break;
+	}
+}
+
+struct wl_display *wl_display_connect(const char *name)
+{
+	wl_list_init(&mock.proxies);
+	mock.display.interface = &wl_display_interface;
+	mock.random = 1;
+	mock.outputs = 1;
+	if (pipe(mock.wake_fds) == -1) {
+		return NULL;
+	}
+	add_global(&wl_compositor_interface, 4);
+	add_global(&zwlr_layer_shell_v1_interface, 4);
+	add_global(&wl_shm_interface, 1);
+	add_global(&wl_output_interface, 4);
+	return (struct wl_display *)&mock.display;
+}
+
+int wl_display_get_fd(struct wl_display *display)
+{
+	return mock.wake_fds[0];
+}
+
+int wl_display_dispatch_pending(struct wl_display *display)
+{
+	/* the first call of each main loop iteration moves the scenario on */
+	if (mock.state && mock.state->loop_stats.iterations !=
+					  mock.last_iteration) {
+		mock.last_iteration = mock.state->loop_stats.iterations;
+		advance();
+	}
+	int count = dispatch();
+	if (mock.phase == PHASE_UNPLUGGED && mock.num_events == 0) {
+		/* released buffers have been delivered, freeing the pools */
+		check_leaks("after unplugging all outputs", 0);
+		mock.phase = PHASE_DONE;
+		stop_requested = 1;
+		wake();
+	}
+	return count;
+}
+
+int wl_display_roundtrip(struct wl_display *display)
+{
+	return dispatch();
+}
+
+int wl_display_flush(struct wl_display *display) { return 0; }
+
+int wl_display_prepare_read(struct wl_display *display)
+{
+	if (mock.num_events > 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return 0;
+}
+
+int wl_display_read_events(struct wl_display *display)
+{
+	char byte;
+	if (mock.woken && read(mock.wake_fds[0], &byte, 1) == 1) {
+		mock.woken = false;
+	}
+	return 0;
+}
+
+void wl_display_cancel_read(struct wl_display *display) {}
+
+/* Check that a cost with MAX_OUTPUTS outputs is not much above that with one
+ */
+static bool check_flat(const char *what, double one, double most, double slack)
+{
+	bool ok = most <= MAX_GROWTH * one + slack;
+	fprintf(stderr, "%s: %s: %.2f us with 1 output, %.2f us with %d\n",
+			ok ? "PASS" : "FAIL", what, 1e6 * one, 1e6 * most,
+			MAX_OUTPUTS);
+	return ok;
+}
+
+static void handle_alarm(int sig) {}
+
+int main(int argc, char **argv)
+{
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s shader.frag\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	/* interrupts poll, without ending the process */
+	struct sigaction sa = {0};
+	sa.sa_handler = handle_alarm;
+	sigaction(SIGALRM, &sa, NULL);
+	char *args[] = {"shaderbg", "--shm", "--stats", "--no-power-policy",
+			"*", argv[1], NULL};
+	int status = shaderbg_main(sizeof(args) / sizeof(args[0]) - 1, args);
+	if (status != EXIT_SUCCESS || mock.phase != PHASE_DONE) {
+		fprintf(stderr, "FAIL: shaderbg stopped before the end of the "
+				"scenario\n");
+		return EXIT_FAILURE;
+	}
+
+	for (int n = 1; n <= MAX_OUTPUTS; n++) {
+		const struct sample *s = &mock.samples[n];
+		fprintf(stderr,
+				"%2d outputs: %.2f ms to show a new output, "
+				"%.2f us per event, %.2f us loop overhead\n",
+				n, 1e3 * s->latency, 1e6 * s->event_cost,
+				1e6 * s->loop_overhead);
+	}
+	const struct sample *one = &mock.samples[1];
+	const struct sample *most = &mock.samples[MAX_OUTPUTS];
+	bool ok = check_flat("time to show a new output", one->latency,
+				  most->latency, LATENCY_SLACK) &
+		  check_flat("time to dispatch an event", one->event_cost,
+				  most->event_cost, EVENT_SLACK) &
+		  check_flat("main loop overhead", one->loop_overhead,
+				  most->loop_overhead, LOOP_SLACK);
+	return ok && !mock.failures ? EXIT_SUCCESS : EXIT_FAILURE;
+}
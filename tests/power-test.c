@@ -0,0 +1,156 @@
+/* Runs the power policy against fake sysfs trees */
+#include "power.h"
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct sysfs_file {
+	const char *path; // relative to the tree's root
+	const char *contents;
+};
+
+struct power_case {
+	const char *name;
+	const struct sysfs_file *files;
+	const char *expected_profile;
+};
+
+static const struct sysfs_file desktop_usb_c[] = {
+		{"power_supply/ucsi-source-psy-USBC000:001/type", "USB\n"},
+		{"power_supply/ucsi-source-psy-USBC000:001/online", "0\n"},
+		{"power_supply/ucsi-source-psy-USBC000:002/type", "USB\n"},
+		{"power_supply/ucsi-source-psy-USBC000:002/online", "0\n"},
+		/* a wireless mouse */
+		{"power_supply/hidpp_battery_0/type", "Battery\n"},
+		{"power_supply/hidpp_battery_0/scope", "Device\n"},
+		{"power_supply/hidpp_battery_0/status", "Discharging\n"},
+		{NULL, NULL}};
+
+static const struct sysfs_file laptop_on_ac[] = {
+		{"power_supply/AC/type", "Mains\n"},
+		{"power_supply/AC/online", "1\n"},
+		{"power_supply/BAT0/type", "Battery\n"},
+		{"power_supply/BAT0/status", "Charging\n"},
+		{NULL, NULL}};
+
+static const struct sysfs_file laptop_discharging[] = {
+		{"power_supply/AC/type", "Mains\n"},
+		{"power_supply/AC/online", "0\n"},
+		{"power_supply/BAT0/type", "Battery\n"},
+		{"power_supply/BAT0/status", "Discharging\n"},
+		{NULL, NULL}};
+
+static const struct sysfs_file laptop_hot[] = {
+		{"power_supply/AC/type", "Mains\n"},
+		{"power_supply/AC/online", "1\n"},
+		{"power_supply/BAT0/type", "Battery\n"},
+		{"power_supply/BAT0/status", "Full\n"},
+		{"thermal/thermal_zone0/temp", "45000\n"},
+		{"thermal/thermal_zone1/temp", "88000\n"},
+		{NULL, NULL}};
+
+static const struct power_case cases[] = {
+		{"desktop with USB-C", desktop_usb_c, "ac"},
+		{"laptop on AC", laptop_on_ac, "ac"},
+		{"laptop discharging", laptop_discharging, "battery"},
+		{"laptop over the throttle temperature", laptop_hot, "hot"},
+};
+
+/* Write contents to root/path, creating the directories on the way */
+static bool write_file(
+		const char *root, const char *path, const char *contents)
+{
+	char full[PATH_MAX];
+	snprintf(full, sizeof(full), "%s/%s", root, path);
+	for (char *c = full + strlen(root) + 1; *c; c++) {
+		if (*c != '/') {
+			continue;
+		}
+		*c = '\0';
+		if (mkdir(full, 0700) == -1 && errno != EEXIST) {
+			fprintf(stderr, "Failed to create '%s'\n", full);
+			return false;
+		}
+		*c = '/';
+	}
+	FILE *f = fopen(full, "w");
+	if (!f) {
+		fprintf(stderr, "Failed to write '%s'\n", full);
+		return false;
+	}
+	fputs(contents, f);
+	return fclose(f) == 0;
+}
+
+/* Remove a directory and everything below it */
+static void remove_tree(const char *path)
+{
+	DIR *dir = opendir(path);
+	if (!dir) {
+		unlink(path);
+		return;
+	}
+	struct dirent *ent;
+	while ((ent = readdir(dir))) {
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+			continue;
+		}
+		char child[PATH_MAX];
+		snprintf(child, sizeof(child), "%s/%s", path, ent->d_name);
+		remove_tree(child);
+	}
+	closedir(dir);
+	rmdir(path);
+}
+
+static bool run_case(const struct power_case *c)
+{
+	char root[] = "/tmp/shaderbg-power-test.XXXXXX";
+	if (!mkdtemp(root)) {
+		fprintf(stderr, "Failed to create a temporary directory\n");
+		return false;
+	}
+	/* both directories exist even if no file is put in them */
+	bool ok = write_file(root, "power_supply/.keep", "") &&
+		  write_file(root, "thermal/.keep", "");
+	for (const struct sysfs_file *f = c->files; ok && f->path; f++) {
+		ok = write_file(root, f->path, f->contents);
+	}
+
+	char power_supply_dir[PATH_MAX], thermal_dir[PATH_MAX];
+	snprintf(power_supply_dir, sizeof(power_supply_dir), "%s/power_supply",
+			root);
+	snprintf(thermal_dir, sizeof(thermal_dir), "%s/thermal", root);
+	struct power_policy policy;
+	power_policy_init(&policy);
+	policy.power_supply_dir = power_supply_dir;
+	policy.thermal_dir = thermal_dir;
+	if (ok) {
+		power_policy_update(&policy, (struct timespec){0, 0});
+		ok = policy.current &&
+		     !strcmp(policy.current->name, c->expected_profile);
+		fprintf(stderr, "%s: %s: got '%s', expected '%s'\n",
+				ok ? "PASS" : "FAIL", c->name,
+				policy.current ? policy.current->name : "none",
+				c->expected_profile);
+	}
+
+	remove_tree(root);
+	return ok;
+}
+
+int main(void)
+{
+	int failed = 0;
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		if (!run_case(&cases[i])) {
+			failed++;
+		}
+	}
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,181 @@
+#include "trace.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* must be a power of two */
+#define TRACE_RING_SIZE (1 << 16)
+#define TRACE_LABEL_LEN 48
+/* how often the writer thread drains the ring */
+#define TRACE_FLUSH_NS 100000000L
+
+struct trace_record {
+	uint64_t start, end; // CLOCK_MONOTONIC nanoseconds
+	const char *name;    // static string; NULL for track names
+	int track;
+	char label[TRACE_LABEL_LEN]; // track name, copied
+};
+
+bool trace_enabled = false;
+
+/* Single producer (the main thread), single consumer (the writer thread) */
+static struct trace_record ring[TRACE_RING_SIZE];
+static atomic_uint_fast64_t ring_head, ring_tail;
+static uint64_t dropped;
+
+static FILE *trace_file;
+static pthread_t writer;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_wake = PTHREAD_COND_INITIALIZER;
+static bool writer_stop;
+static bool first_record = true;
+static int pid;
+
+uint64_t trace_now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000u + (uint64_t)t.tv_nsec;
+}
+
+static struct trace_record *ring_reserve(void)
+{
+	uint64_t head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+	uint64_t tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+	if (head - tail >= TRACE_RING_SIZE) {
+		/* writer has fallen behind; never block the frame loop */
+		dropped++;
+		return NULL;
+	}
+	return &ring[head & (TRACE_RING_SIZE - 1)];
+}
+
+static void ring_commit(void)
+{
+	atomic_fetch_add_explicit(&ring_head, 1, memory_order_release);
+}
+
+void trace_event(const char *name, int track, uint64_t start, uint64_t end)
+{
+	struct trace_record *r = ring_reserve();
+	if (!r) {
+		return;
+	}
+	r->start = start;
+	r->end = end;
+	r->name = name;
+	r->track = track;
+	ring_commit();
+}
+
+void trace_track_name(int track, const char *name)
+{
+	struct trace_record *r = ring_reserve();
+	if (!r) {
+		return;
+	}
+	r->name = NULL;
+	r->track = track;
+	snprintf(r->label, sizeof(r->label), "%s", name);
+	/* keep the JSON string well formed */
+	for (char *c = r->label; *c; c++) {
+		if (*c == '"' || *c == '\\' || (unsigned char)*c < 0x20) {
+			*c = '_';
+		}
+	}
+	ring_commit();
+}
+
+static void write_record(const struct trace_record *r)
+{
+	fputs(first_record ? "\n" : ",\n", trace_file);
+	first_record = false;
+	if (!r->name) {
+		fprintf(trace_file,
+				"{\"name\":\"thread_name\",\"ph\":\"M\","
+				"\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+				pid, r->track, r->label);
+		return;
+	}
+	fprintf(trace_file,
+			"{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+			"\"ts\":%.3f,\"dur\":%.3f}",
+			r->name, pid, r->track, 1e-3 * r->start,
+			1e-3 * (r->end - r->start));
+}
+
+static void drain(void)
+{
+	uint64_t tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+	uint64_t head = atomic_load_explicit(&ring_head, memory_order_acquire);
+	for (; tail != head; tail++) {
+		write_record(&ring[tail & (TRACE_RING_SIZE - 1)]);
+	}
+	atomic_store_explicit(&ring_tail, tail, memory_order_release);
+	fflush(trace_file);
+}
+
+static void *writer_main(void *data)
+{
+	(void)data;
+	pthread_mutex_lock(&writer_lock);
+	while (!writer_stop) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += TRACE_FLUSH_NS;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&writer_wake, &writer_lock, &deadline);
+		pthread_mutex_unlock(&writer_lock);
+		drain();
+		pthread_mutex_lock(&writer_lock);
+	}
+	pthread_mutex_unlock(&writer_lock);
+	return NULL;
+}
+
+bool trace_start(const char *path)
+{
+	trace_file = fopen(path, "w");
+	if (!trace_file) {
+		fprintf(stderr, "Failed to open trace file '%s'\n", path);
+		return false;
+	}
+	pid = (int)getpid();
+	/* The closing bracket is optional in the trace-event format, so the
+	 * file stays loadable even if we are killed */
+	fputs("[", trace_file);
+	if (pthread_create(&writer, NULL, writer_main, NULL) != 0) {
+		fprintf(stderr, "Failed to start trace writer\n");
+		fclose(trace_file);
+		return false;
+	}
+	trace_enabled = true;
+	trace_track_name(TRACE_MAIN_TRACK, "main loop");
+	return true;
+}
+
+void trace_stop(void)
+{
+	if (!trace_enabled) {
+		return;
+	}
+	trace_enabled = false;
+	pthread_mutex_lock(&writer_lock);
+	writer_stop = true;
+	pthread_cond_signal(&writer_wake);
+	pthread_mutex_unlock(&writer_lock);
+	pthread_join(writer, NULL);
+	drain();
+	fputs("\n]\n", trace_file);
+	fclose(trace_file);
+	if (dropped) {
+		fprintf(stderr, "Trace: dropped %llu events\n",
+				(unsigned long long)dropped);
+	}
+}
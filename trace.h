@@ -0,0 +1,49 @@
+#ifndef SHADERBG_TRACE_H
+#define SHADERBG_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Records timed spans of the frame loop in the Chrome trace-event format
+ * (which Perfetto and chrome://tracing can load). Events go into a
+ * preallocated ring buffer, which a background thread drains to the file.
+ *
+ * Tracks are shown as threads; track 0 is the main loop, and each output
+ * gets its own track. */
+
+#define TRACE_MAIN_TRACK 0
+
+#ifdef SHADERBG_TRACE
+
+extern bool trace_enabled;
+
+bool trace_start(const char *path);
+void trace_stop(void);
+uint64_t trace_now(void);
+void trace_event(const char *name, int track, uint64_t start, uint64_t end);
+void trace_track_name(int track, const char *name);
+
+/* TRACE_BEGIN/TRACE_END bracket a span; name must be a string literal */
+#define TRACE_BEGIN(var) uint64_t var = trace_enabled ? trace_now() : 0
+#define TRACE_END(var, name, track)                                            \
+	do {                                                                   \
+		if (trace_enabled) {                                           \
+			trace_event(name, track, var, trace_now());            \
+		}                                                              \
+	} while (0)
+#define TRACE_TRACK_NAME(track, name)                                          \
+	do {                                                                   \
+		if (trace_enabled) {                                           \
+			trace_track_name(track, name);                         \
+		}                                                              \
+	} while (0)
+
+#else
+
+#define TRACE_BEGIN(var)
+#define TRACE_END(var, name, track)
+#define TRACE_TRACK_NAME(track, name)
+
+#endif
+
+#endif